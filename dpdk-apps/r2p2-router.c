@@ -43,6 +43,7 @@
 #include <net/utils.h>
 
 #include <r2p2/api-internal.h>
+#include <r2p2/utils.h>
 
 // Assume even for app and odd for control
 #define BASE_PORT 8000
@@ -261,6 +262,8 @@ static void fc_fw_in(struct rte_mbuf *pkt_buf,
 	policy = r2p2h->type_policy & 0xF;
 
 	if (policy == LB_ROUTE) {
+		// Deadline budgets are charged for the time spent queued here
+		pkt_buf->timestamp = time_us();
 		pending_routed_count++;
 		if (pending_routed_tail)
 			pending_routed_tail->userdata = pkt_buf;
@@ -280,11 +283,19 @@ static void fc_fw_in(struct rte_mbuf *pkt_buf,
 		assert(0);
 }
 
+static void cancel_in(struct rte_mbuf *pkt_buf, struct ipv4_hdr *iph,
+					  struct udp_hdr *udph);
+
 void router_in(struct rte_mbuf *pkt_buf, struct ipv4_hdr *iph,
 			   struct udp_hdr *udph)
 {
+	struct r2p2_header *r2p2h = (struct r2p2_header *)(udph + 1);
+
 	if (is_control(udph))
 		ctrl_in(pkt_buf, iph, udph);
+	else if (get_msg_type(r2p2h) == CANCEL_MSG &&
+			 get_policy(r2p2h) == LB_ROUTE)
+		cancel_in(pkt_buf, iph, udph);
 	else {
 		if (policy == FC)
 			fc_fw_in(pkt_buf, iph, udph);
@@ -353,32 +364,146 @@ int app_init(int argc, char **argv)
 	return 0;
 }
 
-static void send_from_pending_routed(struct target *t)
+static struct udp_hdr *pending_udph(struct rte_mbuf *pkt_buf,
+									struct ipv4_hdr **iph)
 {
 	int iphdrlen;
-	struct rte_mbuf *to_send;
-	struct ipv4_hdr *to_send_iph;
-	struct udp_hdr *to_send_udph;
 
-	to_send = pending_routed_head;
-	pending_routed_head = to_send->userdata;
+	*iph = rte_pktmbuf_mtod_offset(pkt_buf, struct ipv4_hdr *,
+								   sizeof(struct ether_hdr));
+	iphdrlen = ((*iph)->version_ihl & IPV4_HDR_IHL_MASK) * IPV4_IHL_MULTIPLIER;
+	return rte_pktmbuf_mtod_offset(pkt_buf, struct udp_hdr *,
+								   sizeof(struct ether_hdr) + iphdrlen);
+}
+
+static struct rte_mbuf *dequeue_routed(void)
+{
+	struct rte_mbuf *pkt_buf;
+
+	pkt_buf = pending_routed_head;
+	pending_routed_head = pkt_buf->userdata;
 	pending_routed_count--;
 	if (!pending_routed_count)
 		pending_routed_tail = NULL;
+	return pkt_buf;
+}
 
-	to_send_iph = rte_pktmbuf_mtod_offset(to_send, struct ipv4_hdr *,
-										  sizeof(struct ether_hdr));
-	iphdrlen =
-		(to_send_iph->version_ihl & IPV4_HDR_IHL_MASK) * IPV4_IHL_MULTIPLIER;
-	to_send_udph = rte_pktmbuf_mtod_offset(to_send, struct udp_hdr *,
-										   sizeof(struct ether_hdr) + iphdrlen);
+/*
+ * Left of the request deadline after queueing, the budget value is returned
+ * in ext. Requests without a deadline always have time left.
+ */
+static long budget_left(struct rte_mbuf *pkt_buf, struct udp_hdr *udph,
+						void **ext)
+{
+	struct r2p2_header *r2p2h = (struct r2p2_header *)(udph + 1);
+	uint32_t budget;
+
+	*ext = NULL;
+	if (is_first(r2p2h) && get_msg_type(r2p2h) == REQUEST_MSG)
+		*ext = find_ext(r2p2h, EXT_DEADLINE);
+	if (!*ext)
+		return 1;
+	memcpy(&budget, *ext, sizeof(uint32_t));
+	return (long)ntohl(budget) - (time_us() - (long)pkt_buf->timestamp);
+}
 
-	send_to_worker(to_send, to_send_iph, to_send_udph, t);
+// Answer an expired request with a DROP in place of the client
+static void bounce_drop(struct rte_mbuf *pkt_buf, struct ipv4_hdr *iph,
+						struct udp_hdr *udph)
+{
+	struct r2p2_header *r2p2h = (struct r2p2_header *)(udph + 1);
+	uint16_t port;
+
+	r2p2h->header_size = sizeof(struct r2p2_header);
+	r2p2h->type_policy = (DROP_MSG << 4) | FIXED_ROUTE;
+	r2p2h->flags = F_FLAG | L_FLAG;
+	r2p2h->p_order = htons(1);
+	memcpy(r2p2h + 1, "DROP", 4);
+
+	port = udph->src_port;
+	udph->src_port = udph->dst_port;
+	udph->dst_port = port;
+	udph->dgram_len = rte_cpu_to_be_16(sizeof(struct udp_hdr) +
+									   sizeof(struct r2p2_header) + 4);
+	ip_out(pkt_buf, iph, rte_be_to_cpu_32(iph->dst_addr),
+		   rte_be_to_cpu_32(iph->src_addr), iph->time_to_live,
+		   iph->type_of_service, IPPROTO_UDP,
+		   rte_be_to_cpu_16(udph->dgram_len), NULL);
+}
+
+/*
+ * Send the oldest queued request that still has time left to t, bouncing
+ * the ones before it that ran out. Returns 0 if none was left to send.
+ */
+static int send_from_pending_routed(struct target *t)
+{
+	struct rte_mbuf *to_send;
+	struct ipv4_hdr *to_send_iph;
+	struct udp_hdr *to_send_udph;
+	uint32_t budget;
+	long left;
+	void *ext;
+
+	while (pending_routed_count) {
+		to_send = dequeue_routed();
+		to_send_udph = pending_udph(to_send, &to_send_iph);
+		left = budget_left(to_send, to_send_udph, &ext);
+		if (left <= 0) {
+			bounce_drop(to_send, to_send_iph, to_send_udph);
+			continue;
+		}
+
+		// The server starts its clock with what's left
+		if (ext) {
+			budget = htonl(left);
+			memcpy(ext, &budget, sizeof(uint32_t));
+		}
+		send_to_worker(to_send, to_send_iph, to_send_udph, t);
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Take a request its client gave up on out of the queue. Once sent we don't
+ * know the worker anymore, the client cancels with it directly if it heard
+ * back from it.
+ */
+static void cancel_in(struct rte_mbuf *pkt_buf, struct ipv4_hdr *iph,
+					  struct udp_hdr *udph)
+{
+	struct r2p2_header *r2p2h = (struct r2p2_header *)(udph + 1);
+	struct rte_mbuf *prev = NULL, *cur = pending_routed_head;
+	struct ipv4_hdr *cur_iph;
+	struct udp_hdr *cur_udph;
+	struct r2p2_header *cur_r2p2h;
+	int i;
+
+	for (i = 0; i < pending_routed_count; i++) {
+		cur_udph = pending_udph(cur, &cur_iph);
+		cur_r2p2h = (struct r2p2_header *)(cur_udph + 1);
+		if (cur_r2p2h->rid == r2p2h->rid &&
+			cur_udph->src_port == udph->src_port &&
+			cur_iph->src_addr == iph->src_addr)
+			break;
+		prev = cur;
+		cur = cur->userdata;
+	}
+	if (i < pending_routed_count) {
+		if (prev)
+			prev->userdata = cur->userdata;
+		else
+			pending_routed_head = cur->userdata;
+		if (pending_routed_tail == cur)
+			pending_routed_tail = prev;
+		pending_routed_count--;
+		rte_pktmbuf_free(cur);
+	}
+	rte_pktmbuf_free(pkt_buf);
 }
 
 static void send_from_pending_direct(struct target *t)
 {
-	int iphdrlen;
 	struct rte_mbuf *to_send;
 	struct ipv4_hdr *to_send_iph;
 	struct udp_hdr *to_send_udph;
@@ -389,12 +514,7 @@ static void send_from_pending_direct(struct target *t)
 	if (!pending_direct_count)
 		pending_direct_tail = NULL;
 
-	to_send_iph = rte_pktmbuf_mtod_offset(to_send, struct ipv4_hdr *,
-										  sizeof(struct ether_hdr));
-	iphdrlen =
-		(to_send_iph->version_ihl & IPV4_HDR_IHL_MASK) * IPV4_IHL_MULTIPLIER;
-	to_send_udph = rte_pktmbuf_mtod_offset(to_send, struct udp_hdr *,
-										   sizeof(struct ether_hdr) + iphdrlen);
+	to_send_udph = pending_udph(to_send, &to_send_iph);
 
 	send_to_worker(to_send, to_send_iph, to_send_udph, t);
 }
@@ -441,8 +561,10 @@ static void fc_fw_main(void)
 				   (group_idx[per_queue_slots - 1] <
 					target_group_count[per_queue_slots - 1])) {
 				idx = (per_queue_slots - 1) * worker_count +
-					  group_idx[(per_queue_slots - 1)]++;
-				send_from_pending_routed(&targets[target_group[idx]]);
+					  group_idx[(per_queue_slots - 1)];
+				if (!send_from_pending_routed(&targets[target_group[idx]]))
+					break;
+				group_idx[per_queue_slots - 1]++;
 				sent[target_group[idx]]++;
 				avail_slots--;
 				idle_slots--;
@@ -457,8 +579,10 @@ static void fc_fw_main(void)
 			for (i = per_queue_slots - 2; i >= 0; i--) {
 				while (pending_routed_count &&
 					   (group_idx[i] < target_group_count[i])) {
-					idx = i * worker_count + group_idx[i]++;
-					send_from_pending_routed(&targets[target_group[idx]]);
+					idx = i * worker_count + group_idx[i];
+					if (!send_from_pending_routed(&targets[target_group[idx]]))
+						break;
+					group_idx[i]++;
 					sent[target_group[idx]]++;
 					avail_slots--;
 
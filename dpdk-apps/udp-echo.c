@@ -52,6 +52,8 @@ void app_main(void)
 void echo_udp_recv(struct net_sge *entry, struct ip_tuple *id)
 {
 	struct net_sge *new_e = alloc_net_sge();
+	if (!new_e)
+		return;
 	memcpy(new_e->payload, entry->payload, entry->len);
 	local_id.src_ip = id->dst_ip;
 	local_id.dst_ip = id->src_ip;
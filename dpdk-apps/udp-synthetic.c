@@ -69,6 +69,8 @@ void echo_udp_recv(struct net_sge *entry, struct ip_tuple *id)
 {
 	long *reply, *to_spin;
 	struct net_sge *new_e = alloc_net_sge();
+	if (!new_e)
+		return;
 	reply = (long *)new_e->payload;
 	*reply = 42;
 
@@ -0,0 +1,209 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2019-2021 Ecole Polytechnique Federale Lausanne (EPFL)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Test of retries of requests the server freed without a reply, with
+ * dedup on. One request is cancelled before the app replies, the reply of
+ * the other is too large to send. A retry of either has to get a DROP
+ * without reaching the app again. A plain UDP socket on loopback plays
+ * the client, the test turns dedup on whatever the config says.
+ *
+ * ./dedup_drop_test
+ */
+
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <r2p2/api-internal.h>
+#include <r2p2/api.h>
+#include <r2p2/cfg.h>
+#include <r2p2/dedup.h>
+
+#define LISTEN_PORT 8012
+#define CLIENT_PORT 8013
+#define LOOPBACK 0x7f000001
+#define POLL_ROUNDS 1000000
+#define HUGE_IOVCNT 128
+#define HUGE_IOV_LEN (1 << 20)
+
+static int deliveries;
+static long request_handle;
+static char huge[HUGE_IOV_LEN];
+
+static void test_recv(long handle, __attribute__((unused)) struct iovec *iov,
+					  __attribute__((unused)) int iovcnt)
+{
+	deliveries++;
+	request_handle = handle;
+}
+
+// A single-packet message with an epoch, as a client with retries sends it
+static void send_pck(int fd, struct sockaddr_in *to, uint8_t type,
+					 uint16_t rid, uint32_t epoch, const char *payload)
+{
+	char buf[64];
+	struct r2p2_header *r2p2h = (struct r2p2_header *)buf;
+	struct r2p2_ext *ext = (struct r2p2_ext *)(r2p2h + 1);
+	int len = strlen(payload);
+
+	bzero(r2p2h, sizeof(struct r2p2_header));
+	r2p2h->magic = MAGIC;
+	r2p2h->header_size = sizeof(struct r2p2_header);
+	r2p2h->type_policy = (type << 4) | FIXED_ROUTE;
+	r2p2h->flags = F_FLAG | L_FLAG;
+	r2p2h->rid = htons(rid);
+	r2p2h->p_order = htons(1);
+	if (epoch) {
+		ext->type = EXT_EPOCH;
+		ext->len = sizeof(uint32_t);
+		epoch = htonl(epoch);
+		memcpy(ext + 1, &epoch, sizeof(uint32_t));
+		r2p2h->header_size += sizeof(struct r2p2_ext) + sizeof(uint32_t);
+	}
+	memcpy(buf + r2p2h->header_size, payload, len);
+	sendto(fd, buf, r2p2h->header_size + len, 0, (struct sockaddr *)to,
+		   sizeof(struct sockaddr_in));
+}
+
+// Poll until the client socket gets a packet, its type or -1 for none
+static int poll_reply(int fd, uint16_t rid)
+{
+	struct r2p2_header *r2p2h;
+	char buf[2048];
+	int i;
+
+	for (i = 0; i < POLL_ROUNDS; i++) {
+		r2p2_poll();
+		if (recv(fd, buf, sizeof(buf), MSG_DONTWAIT) <
+			(int)sizeof(struct r2p2_header))
+			continue;
+		r2p2h = (struct r2p2_header *)buf;
+		if (ntohs(r2p2h->rid) == rid)
+			return get_msg_type(r2p2h);
+	}
+	return -1;
+}
+
+static void poll_rounds(void)
+{
+	int i;
+
+	for (i = 0; i < POLL_ROUNDS; i++)
+		r2p2_poll();
+}
+
+static int check_retry(int fd, struct sockaddr_in *server, uint16_t rid,
+					   uint32_t epoch, const char *what)
+{
+	int type;
+
+	send_pck(fd, server, REQUEST_MSG, rid, epoch, "ping");
+	type = poll_reply(fd, rid);
+	if (type != DROP_MSG) {
+		fprintf(stderr, "Retry after %s: got %d, want a DROP\n", what, type);
+		return -1;
+	}
+	if (deliveries != 1) {
+		fprintf(stderr, "Retry after %s: %d deliveries, want 1\n", what,
+				deliveries);
+		return -1;
+	}
+	return 0;
+}
+
+int main(void)
+{
+	struct sockaddr_in me, server;
+	struct iovec iov[HUGE_IOVCNT];
+	int fd, i, type;
+
+	fd = socket(AF_INET, SOCK_DGRAM, 0);
+	me.sin_family = AF_INET;
+	me.sin_port = htons(CLIENT_PORT);
+	me.sin_addr.s_addr = htonl(LOOPBACK);
+	if (fd < 0 || bind(fd, (struct sockaddr *)&me, sizeof(me))) {
+		perror("client socket");
+		return 1;
+	}
+	server = me;
+	server.sin_port = htons(LISTEN_PORT);
+
+	if (r2p2_init(LISTEN_PORT)) {
+		fprintf(stderr, "Error initializing r2p2\n");
+		return 1;
+	}
+	CFG.dedup_entries = 64;
+	CFG.dedup_ttl = DEFAULT_DEDUP_TTL;
+	CFG.dedup_buffers = DEFAULT_DEDUP_BUFFERS;
+	CFG.cancel_delivered = 1;
+	CFG.workers = 0;
+	r2p2_set_recv_cb(test_recv);
+	if (r2p2_init_per_core(0, 1)) {
+		fprintf(stderr, "Error initializing r2p2\n");
+		return 1;
+	}
+
+	// Cancelled while the app works on it, the late reply is not sent
+	send_pck(fd, &server, REQUEST_MSG, 1, 7, "ping");
+	poll_rounds();
+	if (deliveries != 1) {
+		fprintf(stderr, "Request not delivered\n");
+		return 1;
+	}
+	send_pck(fd, &server, CANCEL_MSG, 1, 0, "CANCEL");
+	poll_rounds();
+	iov[0].iov_base = "pong";
+	iov[0].iov_len = 4;
+	r2p2_send_response(request_handle, iov, 1);
+	if (check_retry(fd, &server, 1, 7, "a cancelled reply"))
+		return 1;
+
+	// A reply of more than MAX_MSG_PCK packets fails with a DROP
+	deliveries = 0;
+	send_pck(fd, &server, REQUEST_MSG, 2, 8, "ping");
+	poll_rounds();
+	if (deliveries != 1) {
+		fprintf(stderr, "Request not delivered\n");
+		return 1;
+	}
+	for (i = 0; i < HUGE_IOVCNT; i++) {
+		iov[i].iov_base = huge;
+		iov[i].iov_len = HUGE_IOV_LEN;
+	}
+	r2p2_send_response(request_handle, iov, HUGE_IOVCNT);
+	type = poll_reply(fd, 2);
+	if (type != DROP_MSG) {
+		fprintf(stderr, "Oversized reply: got %d, want a DROP\n", type);
+		return 1;
+	}
+	if (check_retry(fd, &server, 2, 8, "an oversized reply"))
+		return 1;
+
+	printf("dedup_drop_test ok\n");
+	return 0;
+}
@@ -0,0 +1,174 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2019-2021 Ecole Polytechnique Federale Lausanne (EPFL)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Test of a request that gets a DROP, an ACK and a NACK after its reply,
+ * as when the server drops a retry of a request it already answered. The
+ * reply has to reach the app once and the late packets nothing, the
+ * handle stays the app's until r2p2_recv_resp_done(). A plain UDP socket
+ * on loopback plays the server.
+ *
+ * ./late_drop_test
+ */
+
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <r2p2/api-internal.h>
+#include <r2p2/api.h>
+
+#define LISTEN_PORT 8010
+#define SERVER_PORT 8011
+#define LOOPBACK 0x7f000001
+#define POLL_ROUNDS 1000000
+
+static int successes, errors, timeouts;
+static long reply_handle;
+
+static void test_success_cb(long handle, __attribute__((unused)) void *arg,
+							struct iovec *iov, int iovcnt)
+{
+	successes++;
+	reply_handle = handle;
+	if (iovcnt != 1 || iov[0].iov_len != 4 ||
+		memcmp(iov[0].iov_base, "pong", 4))
+		errors++;
+}
+
+static void test_error_cb(__attribute__((unused)) void *arg,
+						  __attribute__((unused)) int err)
+{
+	errors++;
+}
+
+static void test_timeout_cb(__attribute__((unused)) void *arg)
+{
+	timeouts++;
+}
+
+// A single-packet message, as a server sends it
+static void send_pck(int fd, struct sockaddr_in *to, uint8_t type,
+					 uint16_t rid, const char *payload)
+{
+	char buf[64];
+	struct r2p2_header *r2p2h = (struct r2p2_header *)buf;
+	int len = strlen(payload);
+
+	bzero(r2p2h, sizeof(struct r2p2_header));
+	r2p2h->magic = MAGIC;
+	r2p2h->header_size = sizeof(struct r2p2_header);
+	r2p2h->type_policy = (type << 4) | FIXED_ROUTE;
+	r2p2h->flags = F_FLAG | L_FLAG;
+	r2p2h->rid = htons(rid);
+	r2p2h->p_order = htons(1);
+	memcpy(r2p2h + 1, payload, len);
+	sendto(fd, buf, sizeof(struct r2p2_header) + len, 0,
+		   (struct sockaddr *)to, sizeof(struct sockaddr_in));
+}
+
+static void poll_until(int *counter)
+{
+	int i;
+
+	for (i = 0; i < POLL_ROUNDS && !*counter; i++)
+		r2p2_poll();
+}
+
+int main(void)
+{
+	struct r2p2_host_tuple server = {LOOPBACK, SERVER_PORT};
+	struct sockaddr_in me, client;
+	socklen_t slen = sizeof(client);
+	struct r2p2_header *r2p2h;
+	struct r2p2_ctx ctx;
+	struct iovec iov;
+	char buf[2048];
+	uint16_t rid;
+	int fd, i;
+
+	fd = socket(AF_INET, SOCK_DGRAM, 0);
+	me.sin_family = AF_INET;
+	me.sin_port = htons(SERVER_PORT);
+	me.sin_addr.s_addr = htonl(LOOPBACK);
+	if (fd < 0 || bind(fd, (struct sockaddr *)&me, sizeof(me))) {
+		perror("server socket");
+		return 1;
+	}
+	if (r2p2_init(LISTEN_PORT) || r2p2_init_per_core(0, 1)) {
+		fprintf(stderr, "Error initializing r2p2\n");
+		return 1;
+	}
+
+	r2p2_ctx_init(&ctx);
+	ctx.success_cb = test_success_cb;
+	ctx.error_cb = test_error_cb;
+	ctx.timeout_cb = test_timeout_cb;
+	ctx.timeout = 1000000;
+	ctx.routing_policy = FIXED_ROUTE;
+	ctx.destination = &server;
+	iov.iov_base = "ping";
+	iov.iov_len = 4;
+	if (!r2p2_send_req_ex(&iov, 1, &ctx)) {
+		fprintf(stderr, "Error sending the request\n");
+		return 1;
+	}
+
+	if (recvfrom(fd, buf, sizeof(buf), 0, (struct sockaddr *)&client,
+				 &slen) < (int)sizeof(struct r2p2_header)) {
+		perror("recvfrom");
+		return 1;
+	}
+	r2p2h = (struct r2p2_header *)buf;
+	rid = ntohs(r2p2h->rid);
+
+	send_pck(fd, &client, RESPONSE_MSG, rid, "pong");
+	poll_until(&successes);
+	if (successes != 1) {
+		fprintf(stderr, "No reply\n");
+		return 1;
+	}
+
+	// Late ones, for an earlier attempt
+	send_pck(fd, &client, DROP_MSG, rid, "DROP");
+	send_pck(fd, &client, ACK_MSG, rid, "ACK");
+	send_pck(fd, &client, NACK_MSG, rid, "");
+	usleep(10000);
+	for (i = 0; i < POLL_ROUNDS; i++)
+		r2p2_poll();
+
+	if (successes != 1 || errors || timeouts) {
+		fprintf(stderr, "%d replies, %d errors, %d timeouts, want 1 0 0\n",
+				successes, errors, timeouts);
+		return 1;
+	}
+	// Still the app's, a completed pair freed by the DROP would fail here
+	r2p2_recv_resp_done(reply_handle);
+
+	printf("late_drop_test ok\n");
+	return 0;
+}
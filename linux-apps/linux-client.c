@@ -63,6 +63,7 @@ static void *thread_main(void *arg)
 	int core_id = (int)(long)arg;
 
 	// configure r2p2 context
+	r2p2_ctx_init(&ctx);
 	ctx.success_cb = test_success_cb;
 	ctx.error_cb = test_error_cb;
 	ctx.timeout_cb = test_timeout_cb;
@@ -0,0 +1,153 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2019-2021 Ecole Polytechnique Federale Lausanne (EPFL)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Microbenchmark of the pair table on the paths r2p2 takes per request: a
+ * pair is inserted when it is sent or received, looked up for its packets
+ * and removed when it completes. It keeps a window of pairs in flight and
+ * replaces the oldest ones batch by batch, as for a steady request rate,
+ * all of them per batch for windows smaller than one.
+ * The keys and the lookup order come from a fixed seed, so runs are
+ * comparable across changes.
+ *
+ * ./pair_table_bench [in_flight] [ops] [lookups_per_op]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <r2p2/pair-table.h>
+
+#define TABLE_SIZE 262144 // as PAIR_TABLE_SIZE in r2p2-common.c
+#define MAX_IN_FLIGHT 65536 // as POOL_SIZE in r2p2-common.c
+#define BATCH 1024 // most ops per timed batch, keeps the clock out of the way
+#define SEED 42
+
+static inline long time_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+// Distinct senders and request ids, as many clients would give
+static uint64_t make_key(struct pair_table *t, uint32_t i)
+{
+	uint64_t key;
+
+	do
+		key = pair_key(0x0a000000 | (rand() & 0xffff),
+					   33000 + (rand() & 0x7f), i & 0xffff);
+	while (pair_table_lookup(t, key));
+	return key;
+}
+
+// Of reading the clock around a batch, taken out of each batch
+static long clock_cost(void)
+{
+	long i, start, total = 0;
+
+	for (i = 0; i < BATCH; i++) {
+		start = time_ns();
+		total += time_ns() - start;
+	}
+	return total / BATCH;
+}
+
+static void report(const char *name, long ns, long ops)
+{
+	printf("%-8s %10ld ops %8.2f ns/op\n", name, ops, (double)ns / ops);
+}
+
+int main(int argc, char **argv)
+{
+	long in_flight = 32768, ops = 10000000, lookups = 2;
+	long i, j, head, start, done, batch, clock_ns, found = 0;
+	long insert_ns = 0, lookup_ns = 0, remove_ns = 0;
+	uint64_t *keys, next[BATCH];
+	uint32_t *probes;
+	struct pair_table *t;
+
+	if (argc > 1)
+		in_flight = atol(argv[1]);
+	if (argc > 2)
+		ops = atol(argv[2]);
+	if (argc > 3)
+		lookups = atol(argv[3]);
+	if (in_flight < 1 || in_flight > MAX_IN_FLIGHT || ops < 1 ||
+		lookups < 0) {
+		fprintf(stderr, "in_flight must be in 1..%d\n", MAX_IN_FLIGHT);
+		return 1;
+	}
+	batch = in_flight < BATCH ? in_flight : BATCH;
+	clock_ns = clock_cost();
+
+	srand(SEED);
+	t = create_pair_table(TABLE_SIZE);
+	keys = malloc(in_flight * sizeof(uint64_t));
+	probes = malloc((BATCH * lookups + 1) * sizeof(uint32_t));
+	if (!keys || !probes)
+		return 1;
+	for (i = 0; i < in_flight; i++) {
+		keys[i] = make_key(t, i);
+		pair_table_insert(t, keys[i], &keys[i]);
+	}
+
+	head = 0;
+	for (done = 0; done < ops; done += batch) {
+		for (j = 0; j < batch * lookups; j++)
+			probes[j] = rand() % in_flight;
+		start = time_ns();
+		for (j = 0; j < batch * lookups; j++)
+			found += pair_table_lookup(t, keys[probes[j]]) != NULL;
+		lookup_ns += time_ns() - start - clock_ns;
+
+		// The oldest ones complete
+		start = time_ns();
+		for (j = 0; j < batch; j++)
+			pair_table_remove(t, keys[(head + j) % in_flight]);
+		remove_ns += time_ns() - start - clock_ns;
+
+		for (j = 0; j < batch; j++)
+			next[j] = make_key(t, in_flight + done + j);
+		start = time_ns();
+		for (j = 0; j < batch; j++) {
+			i = (head + j) % in_flight;
+			keys[i] = next[j];
+			pair_table_insert(t, keys[i], &keys[i]);
+		}
+		insert_ns += time_ns() - start - clock_ns;
+		head = (head + batch) % in_flight;
+	}
+
+	printf("in_flight %ld table %d\n", in_flight, TABLE_SIZE);
+	report("insert", insert_ns, done);
+	if (lookups)
+		report("lookup", lookup_ns, done * lookups);
+	report("remove", remove_ns, done);
+	// Every lookup is of a pair in flight
+	return found != done * lookups;
+}
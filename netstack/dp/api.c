@@ -41,13 +41,16 @@ void set_net_ops(struct net_ops *ops)
 	global_ops = ops;
 }
 
-struct net_sge *alloc_net_sge(void)
+static struct net_sge *init_net_sge(struct rte_mbuf *pkt_buf)
 {
 	struct net_sge *e;
-	struct rte_mbuf *pkt_buf = rte_pktmbuf_alloc(pktmbuf_pool);
-	assert(pkt_buf);
+
 	pkt_buf->userdata = NULL;
-	e = rte_pktmbuf_mtod(pkt_buf, struct net_sge *);
+	/*
+	 * Keep the entry in the headroom, the headers written on send would
+	 * overwrite it otherwise
+	 */
+	e = (struct net_sge *)pkt_buf->buf_addr;
 	e->len = 0;
 
 	e->payload = rte_pktmbuf_mtod_offset(pkt_buf, void *, UDP_HDRS_LEN);
@@ -55,6 +58,27 @@ struct net_sge *alloc_net_sge(void)
 	return e;
 }
 
+struct net_sge *alloc_net_sge(void)
+{
+	struct rte_mbuf *pkt_buf = rte_pktmbuf_alloc(pktmbuf_pool);
+	if (!pkt_buf)
+		return NULL;
+	return init_net_sge(pkt_buf);
+}
+
+int alloc_net_sges(struct net_sge **entries, int count)
+{
+	struct rte_mbuf **pkt_bufs = (struct rte_mbuf **)entries;
+	int i;
+
+	// The mbuf pointers are replaced by their entries in place
+	if (rte_pktmbuf_alloc_bulk(pktmbuf_pool, pkt_bufs, count))
+		return -1;
+	for (i = 0; i < count; i++)
+		entries[i] = init_net_sge(pkt_bufs[i]);
+	return 0;
+}
+
 void net_poll(void)
 {
 	dpdk_net_poll();
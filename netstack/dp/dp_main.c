@@ -74,7 +74,7 @@ int main(int argc, char **argv)
 	signal(SIGTERM, signal_handler);
 
 	if (parse_config()) {
-		printf("cfg error\n");
+		printf("cfg error, %s is needed\n", CFG_PATH);
 		return -1;
 	}
 
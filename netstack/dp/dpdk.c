@@ -47,9 +47,12 @@ struct rte_mempool *pktmbuf_pool;
 #ifndef NO_BATCH
 static RTE_DEFINE_PER_LCORE(int, packet_count);
 #endif
+static RTE_DEFINE_PER_LCORE(int, tx_batching);
+static RTE_DEFINE_PER_LCORE(int, tx_batch_count);
+static RTE_DEFINE_PER_LCORE(struct rte_mbuf *[TX_BATCH_SIZE], tx_batch);
 static uint8_t nb_ports;
 
-static const struct rte_eth_conf port_conf = {
+static struct rte_eth_conf port_conf = {
 	.rxmode =
 		{
 			.split_hdr_size = 0,
@@ -83,6 +86,7 @@ void dpdk_init(int *argc, char ***argv)
 	uint16_t nb_tx_q;
 	uint16_t nb_tx_desc = ETH_DEV_TX_QUEUE_SZ; // 4096
 	uint16_t nb_rx_desc = ETH_DEV_RX_QUEUE_SZ; // 512
+	uint16_t mbuf_size;
 	struct rte_eth_link link;
 
 	/* init EAL */
@@ -100,10 +104,19 @@ void dpdk_init(int *argc, char ***argv)
 	nb_tx_q = rte_lcore_count();
 #endif
 
+	/* size the mbufs and the port for the configured MTU */
+	if (ETH_MTU > DEFAULT_MTU) {
+		port_conf.rxmode.jumbo_frame = 1;
+		port_conf.rxmode.max_rx_pkt_len = ETH_MTU + ETHER_HDR_LEN +
+			ETHER_CRC_LEN;
+	}
+	mbuf_size = RTE_MAX((unsigned)RTE_MBUF_DEFAULT_BUF_SIZE,
+			RTE_PKTMBUF_HEADROOM + ETH_MTU + ETHER_HDR_LEN + ETHER_CRC_LEN);
+
 	/* create the mbuf pool */
 	pktmbuf_pool =
 		rte_pktmbuf_pool_create("mbuf_pool", NB_MBUF, MEMPOOL_CACHE_SIZE, 0,
-				RTE_MBUF_DEFAULT_BUF_SIZE, rte_socket_id());
+				mbuf_size, rte_socket_id());
 	if (pktmbuf_pool == NULL)
 		rte_exit(EXIT_FAILURE, "Cannot init mbuf pool\n");
 
@@ -121,6 +134,12 @@ void dpdk_init(int *argc, char ***argv)
 				ret, (unsigned)port_id);
 	}
 
+	ret = rte_eth_dev_set_mtu(port_id, ETH_MTU);
+	if (ret < 0) {
+		rte_exit(EXIT_FAILURE, "rte_eth_dev_set_mtu:err=%d, port=%u\n",
+				ret, (unsigned)port_id);
+	}
+
 	/* enable multicast */
 	rte_eth_allmulticast_enable(port_id);
 
@@ -209,6 +228,31 @@ void dpdk_close(void)
 	}
 }
 
+static void tx_batch_flush(void)
+{
+	int sent = 0;
+
+	while (sent < RTE_PER_LCORE(tx_batch_count))
+		sent += rte_eth_tx_burst(0, RTE_PER_LCORE(queue_id),
+				&RTE_PER_LCORE(tx_batch)[sent],
+				RTE_PER_LCORE(tx_batch_count) - sent);
+	RTE_PER_LCORE(tx_batch_count) = 0;
+}
+
+/*
+ * Packets sent between begin and end go out with a single tx burst
+ */
+void dpdk_tx_batch_begin(void)
+{
+	RTE_PER_LCORE(tx_batching) = 1;
+}
+
+void dpdk_tx_batch_end(void)
+{
+	tx_batch_flush();
+	RTE_PER_LCORE(tx_batching) = 0;
+}
+
 int dpdk_eth_send(struct rte_mbuf *pkt_buf, uint16_t len)
 {
 	int ret = 0;
@@ -217,6 +261,13 @@ int dpdk_eth_send(struct rte_mbuf *pkt_buf, uint16_t len)
 	pkt_buf->pkt_len = len;
 	pkt_buf->data_len = len;
 
+	if (RTE_PER_LCORE(tx_batching)) {
+		RTE_PER_LCORE(tx_batch)[RTE_PER_LCORE(tx_batch_count)++] = pkt_buf;
+		if (RTE_PER_LCORE(tx_batch_count) == TX_BATCH_SIZE)
+			tx_batch_flush();
+		return 1;
+	}
+
 #ifdef NO_BATCH
 	while (1) {
 		ret = rte_eth_tx_burst(0, RTE_PER_LCORE(queue_id), &pkt_buf, 1);
@@ -252,6 +303,15 @@ void dpdk_flush(void)
 #endif
 }
 
+int dpdk_rx_backlog(void)
+{
+	int ret;
+
+	ret = rte_eth_rx_queue_count(0, RTE_PER_LCORE(queue_id));
+	// Not all drivers support it
+	return ret < 0 ? 0 : ret;
+}
+
 void dpdk_net_poll(void)
 {
 	int ret, i;
@@ -26,6 +26,7 @@
 #include <stdio.h>
 
 #include <dp/api.h>
+#include <dp/dpdk_api.h>
 #include <net/net.h>
 
 #include <rte_cycles.h>
@@ -36,35 +37,24 @@
 #include <r2p2/api.h>
 #include <r2p2/cfg.h>
 #include <r2p2/mempool.h>
+#include <r2p2/submit.h>
+#include <r2p2/workers.h>
 #ifdef WITH_RAFT
 #include <r2p2/hovercraft.h>
 #endif
-#define TIMER_POOL_SIZE 4096
 
 static __thread uint16_t local_port;
 static __thread struct r2p2_host_tuple local_host;
-static __thread struct fixed_mempool *client_req_timers;
-static __thread uint32_t loop_count;
+// The first is local_port, the others only take responses
+static __thread uint16_t client_ports[RID_PORTS];
 #ifdef WITH_RAFT
+static __thread uint32_t loop_count;
 static __thread struct rte_timer raft_timer;
 static __thread long raft_timer_last = 0;
 #endif
 
-static void dpdk_on_client_pair_free(void *data)
-{
-	free_object(data);
-}
-
-static void handle_timer_for_client_req(struct rte_timer *req_timer, void *arg)
-{
-	struct r2p2_client_pair *cp = (struct r2p2_client_pair *)arg;
-
-	rte_timer_stop(req_timer);
-	timer_triggered(cp);
-}
-
 #ifdef FDIR
-static int configure_fdir(int queue_id)
+static int configure_fdir(int queue_id, uint16_t port)
 {
 	int ret;
 	struct rte_flow *f;
@@ -89,7 +79,7 @@ static int configure_fdir(int queue_id)
 	pattern[1].mask = &ipv4_mask;
 
 	/*// Filter UDP based on port*/
-	udp.hdr.dst_port = rte_cpu_to_be_16(local_port);
+	udp.hdr.dst_port = rte_cpu_to_be_16(port);
 	udp_mask.hdr.dst_port = 0xFFFF;
 	pattern[2].type = RTE_FLOW_ITEM_TYPE_UDP;
 	pattern[2].spec = &udp;
@@ -113,7 +103,8 @@ static int configure_fdir(int queue_id)
 	return 0;
 }
 #else
-static int configure_fdir(__attribute__((unused)) int queue_id)
+static int configure_fdir(__attribute__((unused)) int queue_id,
+						  __attribute__((unused)) uint16_t port)
 {
 	return 0;
 }
@@ -129,14 +120,16 @@ static void r2p2lib_udp_recv(struct net_sge *entry, struct ip_tuple *id)
 	/*}*/
 	/*assert(is_first(r2p2h));*/
 	struct rte_mbuf *pkt_buf;
-	struct r2p2_host_tuple source;
+	struct r2p2_host_tuple source, local;
 
 	source.ip = id->src_ip;
 	source.port = id->src_port;
+	// Responses come back to the client port of their request
+	local.ip = local_host.ip;
+	local.port = id->dst_port;
 	pkt_buf = entry->handle;
 	pkt_buf->userdata = NULL;
-	handle_incoming_pck((generic_buffer)entry, entry->len, &source,
-						&local_host);
+	handle_incoming_pck((generic_buffer)entry, entry->len, &source, &local);
 }
 
 #ifdef WITH_RAFT
@@ -168,8 +161,10 @@ int r2p2_init(__attribute__((unused)) int local_port)
 	return 0;
 }
 
-int r2p2_init_per_core(int queue_id, __attribute__((unused)) int core_count)
+int r2p2_init_per_core(int queue_id, int core_count)
 {
+	int i;
+
 #ifdef FDIR
 	local_port = get_local_port() + queue_id;
 #else
@@ -178,12 +173,11 @@ int r2p2_init_per_core(int queue_id, __attribute__((unused)) int core_count)
 	local_host.ip = get_local_ip();
 	local_host.port = local_port;
 
-	configure_fdir(queue_id);
-
-	// Allocate timers
-	client_req_timers =
-		create_mempool(TIMER_POOL_SIZE, sizeof(struct rte_timer));
-	assert(client_req_timers);
+	// Past the ports of all cores, interleaved like them
+	for (i = 0; i < RID_PORTS; i++) {
+		client_ports[i] = local_port + i * core_count;
+		configure_fdir(queue_id, client_ports[i]);
+	}
 
 #ifdef WITH_RAFT
 	uint64_t hz;
@@ -205,9 +199,12 @@ int r2p2_init_per_core(int queue_id, __attribute__((unused)) int core_count)
 void r2p2_poll(void)
 {
 	net_poll();
+	r2p2_run_timers();
+	submit_drain();
+	workers_poll();
+#ifdef WITH_RAFT
 	if (loop_count++ % 256 == 0)
 		rte_timer_manage();
-#ifdef WITH_RAFT
 	do_raft_duties();
 #endif
 }
@@ -228,11 +225,15 @@ generic_buffer get_buffer(void)
 	struct net_sge *entry;
 
 	entry = alloc_net_sge();
-	assert(entry);
 
 	return (generic_buffer)entry;
 }
 
+int get_buffers(generic_buffer *bufs, int count)
+{
+	return alloc_net_sges((struct net_sge **)bufs, count);
+}
+
 void *get_buffer_payload(generic_buffer gb)
 {
 	struct net_sge *entry = (struct net_sge *)gb;
@@ -274,39 +275,33 @@ generic_buffer get_buffer_next(generic_buffer gb)
  * R2P2 internal API
  */
 
+/*
+ * The socket_info of a client pair is the port its rid is unique on, the
+ * others send from local_port
+ */
 int prepare_to_send(struct r2p2_client_pair *cp)
 {
-	struct rte_timer *req_timer;
-	uint64_t hz;
-	double timer_sec;
-
-	req_timer = alloc_object(client_req_timers);
-	assert(req_timer);
-
-	rte_timer_init(req_timer);
-	hz = rte_get_timer_hz(); // cycles in a second
-	timer_sec = cp->ctx->timeout / 1000000.0;
-
-	rte_timer_reset(req_timer, timer_sec * hz, SINGLE, rte_lcore_id(),
-					handle_timer_for_client_req, cp);
-
-	cp->timer = req_timer;
-	cp->impl_data = (void *)req_timer;
-	cp->on_free = dpdk_on_client_pair_free;
 	cp->request.sender = local_host;
+	cp->request.sender.port = client_ports[cp->rid_port];
+	cp->impl_data = (void *)(uintptr_t)cp->request.sender.port;
 
 	return 0;
 }
 
+static inline uint16_t src_port(void *socket_info)
+{
+	return socket_info ? (uint16_t)(uintptr_t)socket_info : local_port;
+}
+
 int buf_list_send(generic_buffer first_buf, struct r2p2_host_tuple *dest,
-				  __attribute__((unused)) void *socket_info)
+				  void *socket_info)
 {
 	generic_buffer gb;
 	struct ip_tuple id;
 	struct net_sge *entry;
 
 	id.src_ip = get_local_ip();
-	id.src_port = local_port;
+	id.src_port = src_port(socket_info);
 	id.dst_ip = dest->ip;
 	id.dst_port = dest->port;
 
@@ -320,13 +315,41 @@ int buf_list_send(generic_buffer first_buf, struct r2p2_host_tuple *dest,
 	return 0;
 }
 
-int disarm_timer(void *timer)
+int buf_burst_send(generic_buffer *bufs, struct r2p2_host_tuple **dests,
+				   void **socket_infos, int count)
 {
-	struct rte_timer *req_timer = (struct rte_timer *)timer;
-	rte_timer_stop(req_timer);
+	struct ip_tuple id;
+	int i;
+
+	id.src_ip = get_local_ip();
+
+	dpdk_tx_batch_begin();
+	for (i = 0; i < count; i++) {
+		id.src_port = src_port(socket_infos[i]);
+		id.dst_ip = dests[i]->ip;
+		id.dst_port = dests[i]->port;
+		// The mbuf is the driver's once sent, don't leave a chain in it
+		chain_buffers(bufs[i], NULL);
+		udp_send((struct net_sge *)bufs[i], &id);
+	}
+	dpdk_tx_batch_end();
+
 	return 0;
 }
 
+void retain_buffer(generic_buffer gb)
+{
+	struct net_sge *entry = (struct net_sge *)gb;
+
+	// The driver frees the mbuf once sent, keep a reference for us
+	rte_mbuf_refcnt_update(entry->handle, 1);
+}
+
+int rx_backlog(void)
+{
+	return dpdk_rx_backlog();
+}
+
 void router_notify(uint32_t ip, uint16_t port, uint16_t rid)
 {
 #if defined(FDIR) || defined(ACCELERATED)
@@ -337,7 +360,8 @@ void router_notify(uint32_t ip, uint16_t port, uint16_t rid)
 	dest.port = CFG.router_port;
 
 	gb = get_buffer();
-	assert(gb);
+	if (!gb)
+		return;
 	set_buffer_payload_size(gb, sizeof(struct r2p2_header) +
 			sizeof(struct r2p2_feedback));
 	r2p2_prepare_feedback(get_buffer_payload(gb), ip, port, rid);
@@ -53,6 +53,8 @@ void app_main(void);
 void set_net_ops(struct net_ops *ops);
 void net_poll(void);
 struct net_sge *alloc_net_sge(void);
+// All count of them or none, -1
+int alloc_net_sges(struct net_sge **entries, int count);
 
 /* UDP application calls */
 static inline int udp_send(struct net_sge *entry, struct ip_tuple *id)
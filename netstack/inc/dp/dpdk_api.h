@@ -34,5 +34,8 @@ extern struct rte_mempool *pktmbuf_pool;
 void dpdk_init(int *argc, char ***argv);
 void dpdk_close(void);
 void dpdk_net_poll(void);
+int dpdk_rx_backlog(void);
 int dpdk_eth_send(struct rte_mbuf *pkt_buf, uint16_t len);
 void dpdk_flush(void);
+void dpdk_tx_batch_begin(void);
+void dpdk_tx_batch_end(void);
@@ -26,6 +26,7 @@
 
 #define MEMPOOL_CACHE_SIZE 64
 #define NB_MBUF 65536 - 1
+#define TX_BATCH_SIZE 64
 #ifdef ROUTER
 #define ETH_DEV_RX_QUEUE_SZ 4096
 #define ETH_DEV_TX_QUEUE_SZ 2048
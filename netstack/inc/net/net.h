@@ -41,7 +41,7 @@
 
 #include <r2p2/cfg.h>
 
-#define ETH_MTU 1500
+#define ETH_MTU CFG.mtu
 #define UDP_MAX_LEN (ETH_MTU - sizeof(struct ipv4_hdr) - sizeof(struct udp_hdr))
 #define L2_HDR_LEN sizeof(struct ether_hdr)
 #define L3_HDR_LEN (L2_HDR_LEN + sizeof(struct ipv4_hdr))
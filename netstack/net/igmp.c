@@ -45,6 +45,7 @@ static void igmp_handle_membership_query(void)
 
 	for (i=0;i<CFG.multicast_cnt;i++) {
 		entry = alloc_net_sge();
+		assert(entry);
 		pkt_buf = entry->handle;
 		iph = rte_pktmbuf_mtod_offset(pkt_buf, struct ipv4_hdr *, L2_HDR_LEN);
 		igmph = rte_pktmbuf_mtod_offset(pkt_buf, struct igmpv2_hdr *,
@@ -0,0 +1,121 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2019-2021 Ecole Polytechnique Federale Lausanne (EPFL)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <assert.h>
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <r2p2/admission.h>
+#include <r2p2/api-internal.h>
+#include <r2p2/api.h>
+#include <r2p2/cfg.h>
+#include <r2p2/utils.h>
+
+static __thread struct {
+	uint32_t inflight;
+	long first_above; // when the sojourn time has been above target for long
+	long drop_next;
+	uint32_t drop_count;
+	int dropping;
+	struct r2p2_admission_stats stats;
+} adm;
+
+/*
+ * CoDel's control law: once the sojourn time stayed above target for a
+ * whole interval, reject at a rate that grows with the square root of the
+ * rejections so far until it comes back below target
+ */
+static int should_reject_now(void)
+{
+	long now;
+
+	if (!adm.dropping)
+		return 0;
+	now = time_us();
+	if (now < adm.drop_next)
+		return 0;
+	adm.drop_count++;
+	adm.drop_next = now + CFG.adm_interval / sqrt(adm.drop_count);
+	return 1;
+}
+
+int admission_admit(void)
+{
+	if ((CFG.adm_max_inflight && adm.inflight >= CFG.adm_max_inflight) ||
+		(CFG.adm_max_rx_backlog &&
+		 (uint32_t)rx_backlog() > CFG.adm_max_rx_backlog) ||
+		should_reject_now()) {
+		adm.stats.rejected++;
+		return 0;
+	}
+	adm.inflight++;
+	adm.stats.admitted++;
+	return 1;
+}
+
+void admission_reject(void)
+{
+	adm.stats.rejected++;
+}
+
+void admission_started(long arrived_at)
+{
+	long now, sojourn;
+
+	if (!CFG.adm_target)
+		return;
+
+	now = time_us();
+	sojourn = now - arrived_at;
+	if (sojourn < CFG.adm_target) {
+		adm.first_above = 0;
+		adm.dropping = 0;
+		return;
+	}
+	if (!adm.first_above)
+		adm.first_above = now + CFG.adm_interval;
+	else if (!adm.dropping && now >= adm.first_above) {
+		adm.dropping = 1;
+		adm.drop_count = 0;
+		adm.drop_next = now;
+	}
+}
+
+void admission_done(void)
+{
+	assert(adm.inflight);
+	adm.inflight--;
+}
+
+uint32_t admission_inflight(void)
+{
+	return adm.inflight;
+}
+
+void r2p2_get_admission_stats(struct r2p2_admission_stats *stats)
+{
+	*stats = adm.stats;
+	stats->inflight = adm.inflight;
+}
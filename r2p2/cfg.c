@@ -26,10 +26,15 @@
 #include <arpa/inet.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <libconfig.h>
 
+#include <r2p2/admission.h>
 #include <r2p2/cfg.h>
+#include <r2p2/client-lb.h>
+#include <r2p2/dedup.h>
+#include <r2p2/workers.h>
 #ifdef WITH_RAFT
 #include <r2p2/hovercraft.h>
 #endif
@@ -41,8 +46,6 @@
 struct cfg_parameters CFG;
 config_t cfg;
 
-#define CFG_PATH "/etc/r2p2.conf"
-
 static int parse_addr(const char *name, uint32_t *dst)
 {
 	struct sockaddr_in router_addr;
@@ -148,6 +151,153 @@ static int parse_multicast(void)
 }
 #endif
 
+static int parse_mtu(void)
+{
+	const config_setting_t *paths = NULL, *entry = NULL;
+	const char *ip = NULL;
+	int i, mtu = DEFAULT_MTU;
+	uint32_t ip_int;
+
+	config_lookup_int(&cfg, "mtu", &mtu);
+	if (mtu < MIN_MTU || mtu > MAX_MTU) {
+		fprintf(stderr, "mtu should be between %d and %d\n", MIN_MTU,
+				MAX_MTU);
+		return -1;
+	}
+	CFG.mtu = mtu;
+
+	// Optional per destination overrides, e.g. peers without jumbo frames
+	paths = config_lookup(&cfg, "path_mtu");
+	if (!paths)
+		return 0;
+
+	for (i = 0; i < config_setting_length(paths); ++i) {
+		mtu = -1;
+		entry = config_setting_get_elem(paths, i);
+		config_setting_lookup_string(entry, "ip", &ip);
+		config_setting_lookup_int(entry, "mtu", &mtu);
+		if (!ip || mtu < MIN_MTU || CFG.path_mtu_cnt == MAX_PATH_MTUS) {
+			fprintf(stderr, "Error parsing path mtu\n");
+			return -1;
+		}
+		inet_pton(AF_INET, ip, &ip_int);
+		CFG.path_mtus[CFG.path_mtu_cnt].ip = be32toh(ip_int);
+		CFG.path_mtus[CFG.path_mtu_cnt++].mtu = mtu < CFG.mtu ? mtu : CFG.mtu;
+	}
+	return 0;
+}
+
+static int parse_admission(void)
+{
+	int target = 0, interval = DEFAULT_ADM_INTERVAL, max_inflight = 0,
+		max_rx_backlog = 0;
+
+	config_lookup_int(&cfg, "admission.target_us", &target);
+	config_lookup_int(&cfg, "admission.interval_us", &interval);
+	config_lookup_int(&cfg, "admission.max_inflight", &max_inflight);
+	config_lookup_int(&cfg, "admission.max_rx_backlog", &max_rx_backlog);
+	if (target < 0 || interval <= 0 || max_inflight < 0 ||
+		max_rx_backlog < 0) {
+		fprintf(stderr, "Error parsing admission\n");
+		return -1;
+	}
+	CFG.adm_target = target;
+	CFG.adm_interval = interval;
+	CFG.adm_max_inflight = max_inflight;
+	CFG.adm_max_rx_backlog = max_rx_backlog;
+	return 0;
+}
+
+static int parse_dedup(void)
+{
+	int entries = 0, ttl = DEFAULT_DEDUP_TTL, buffers = DEFAULT_DEDUP_BUFFERS;
+
+	config_lookup_int(&cfg, "dedup.entries", &entries);
+	config_lookup_int(&cfg, "dedup.ttl_us", &ttl);
+	config_lookup_int(&cfg, "dedup.buffers", &buffers);
+	if (entries < 0 || ttl <= 0 || buffers < 0) {
+		fprintf(stderr, "Error parsing dedup\n");
+		return -1;
+	}
+	CFG.dedup_entries = entries;
+	CFG.dedup_ttl = ttl;
+	CFG.dedup_buffers = buffers;
+	return 0;
+}
+
+static int parse_cancel_delivered(void)
+{
+	int cancel = 0;
+
+	config_lookup_int(&cfg, "cancel_delivered", &cancel);
+	if (cancel < 0 || cancel > 1) {
+		fprintf(stderr, "cancel_delivered should be 0 or 1\n");
+		return -1;
+	}
+	CFG.cancel_delivered = cancel;
+	return 0;
+}
+
+/*
+ * The targets are listed as the router takes them,
+ * "ip:base_port:count,..." for count ports from base_port on each ip
+ */
+static int parse_client_lb(void)
+{
+	const char *targets = NULL, *policy = NULL;
+	char buf[1024], *rest, *token, *ip, *port, *count;
+	uint32_t ip_int;
+	int i, n;
+
+	config_lookup_string(&cfg, "client_lb.targets", &targets);
+	if (!targets)
+		return 0;
+	config_lookup_string(&cfg, "client_lb.policy", &policy);
+	if (!policy || !strcmp(policy, "p2c"))
+		CFG.lb_policy = CLIENT_LB_P2C;
+	else if (!strcmp(policy, "jsq"))
+		CFG.lb_policy = CLIENT_LB_JSQ;
+	else {
+		fprintf(stderr, "Unknown client_lb policy %s\n", policy);
+		return -1;
+	}
+
+	snprintf(buf, sizeof(buf), "%s", targets);
+	rest = buf;
+	while ((token = strtok_r(rest, ",", &rest))) {
+		ip = strtok_r(token, ":", &token);
+		port = strtok_r(token, ":", &token);
+		count = strtok_r(token, ":", &token);
+		n = count ? atoi(count) : 0;
+		if (!port || n <= 0 || CFG.lb_target_cnt + n > MAX_LB_TARGETS ||
+			inet_pton(AF_INET, ip, &ip_int) != 1) {
+			fprintf(stderr, "Error parsing client_lb targets\n");
+			return -1;
+		}
+		for (i = 0; i < n; i++) {
+			CFG.lb_targets[CFG.lb_target_cnt].ip = be32toh(ip_int);
+			CFG.lb_targets[CFG.lb_target_cnt++].port = atoi(port) + i;
+		}
+	}
+	return 0;
+}
+
+static int parse_workers(void)
+{
+	int count = 0, depth = DEFAULT_WORKER_DEPTH;
+
+	config_lookup_int(&cfg, "workers.count", &count);
+	config_lookup_int(&cfg, "workers.depth", &depth);
+	if (count < 0 || count > MAX_WORKERS || depth <= 0 ||
+		depth > MAX_WORKER_DEPTH) {
+		fprintf(stderr, "Error parsing workers\n");
+		return -1;
+	}
+	CFG.workers = count;
+	CFG.worker_depth = depth;
+	return 0;
+}
+
 #ifdef WITH_RAFT
 static int parse_raft_peers(void)
 {
@@ -184,9 +334,15 @@ static int parse_raft_peers(void)
 int parse_config(void)
 {
 	int ret;
+	CFG.mtu = DEFAULT_MTU;
 	config_init(&cfg);
 
 	if (!config_read_file(&cfg, CFG_PATH)) {
+		// Not an error for apps that run on the defaults
+		if (config_error_type(&cfg) == CONFIG_ERR_FILE_IO) {
+			config_destroy(&cfg);
+			return 1;
+		}
 		fprintf(stderr, "Error parsing config %s:%d - %s\n",
 				config_error_file(&cfg), config_error_line(&cfg),
 				config_error_text(&cfg));
@@ -206,6 +362,42 @@ int parse_config(void)
 		CFG.router_port = 0;
 	}
 
+	ret = parse_mtu();
+	if (ret) {
+		config_destroy(&cfg);
+		return ret;
+	}
+
+	ret = parse_admission();
+	if (ret) {
+		config_destroy(&cfg);
+		return ret;
+	}
+
+	ret = parse_dedup();
+	if (ret) {
+		config_destroy(&cfg);
+		return ret;
+	}
+
+	ret = parse_cancel_delivered();
+	if (ret) {
+		config_destroy(&cfg);
+		return ret;
+	}
+
+	ret = parse_client_lb();
+	if (ret) {
+		config_destroy(&cfg);
+		return ret;
+	}
+
+	ret = parse_workers();
+	if (ret) {
+		config_destroy(&cfg);
+		return ret;
+	}
+
 #ifdef WITH_TIMESTAMPING
 	ret = parse_ifname();
 	if (ret) {
@@ -0,0 +1,95 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2019-2021 Ecole Polytechnique Federale Lausanne (EPFL)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdlib.h>
+
+#include <r2p2/cfg.h>
+#include <r2p2/client-lb.h>
+#include <r2p2/utils.h>
+
+/*
+ * A target that looked busy gets picked less and less often, so its old
+ * report would stick around. It is only trusted for a while.
+ */
+#define LOAD_HINT_TTL 10000 // us
+
+static __thread struct {
+	uint32_t outstanding;
+	uint16_t load;
+	long reported_at;
+} targets[MAX_LB_TARGETS];
+
+static inline uint32_t target_score(int target, long now)
+{
+	if (now - targets[target].reported_at > LOAD_HINT_TTL)
+		return targets[target].outstanding;
+	return targets[target].outstanding + targets[target].load;
+}
+
+int client_lb_enabled(void)
+{
+	return CFG.lb_target_cnt > 0;
+}
+
+int client_lb_pick(void)
+{
+	int i, best, other;
+	long now = time_us();
+
+	if (CFG.lb_policy == CLIENT_LB_JSQ) {
+		best = 0;
+		for (i = 1; i < CFG.lb_target_cnt; i++)
+			if (target_score(i, now) < target_score(best, now))
+				best = i;
+	} else {
+		best = rand() % CFG.lb_target_cnt;
+		if (CFG.lb_target_cnt > 1) {
+			// Two distinct ones
+			other = rand() % (CFG.lb_target_cnt - 1);
+			if (other >= best)
+				other++;
+			if (target_score(other, now) < target_score(best, now))
+				best = other;
+		}
+	}
+
+	targets[best].outstanding++;
+	return best;
+}
+
+struct r2p2_host_tuple *client_lb_target(int target)
+{
+	return &CFG.lb_targets[target];
+}
+
+void client_lb_done(int target)
+{
+	targets[target].outstanding--;
+}
+
+void client_lb_report(int target, uint16_t load)
+{
+	targets[target].load = load;
+	targets[target].reported_at = time_us();
+}
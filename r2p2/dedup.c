@@ -0,0 +1,180 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2019-2021 Ecole Polytechnique Federale Lausanne (EPFL)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <assert.h>
+#include <stdlib.h>
+
+#include <r2p2/api-internal.h>
+#include <r2p2/cfg.h>
+#include <r2p2/dedup.h>
+#include <r2p2/pair-table.h>
+#include <r2p2/utils.h>
+
+struct dedup_entry {
+	uint64_t key;
+	uint32_t epoch;
+	long started_at;
+	uint8_t replied;
+	uint8_t resent; // the cached reply went out before
+	struct r2p2_msg reply; // a copy owned by the cache
+};
+
+// A ring in start order, so both eviction policies take the oldest
+static __thread struct dedup_entry *entries;
+static __thread uint32_t oldest, next;
+static __thread struct pair_table *index_table;
+// Taken from the packet pool the receive path needs too
+static __thread uint32_t held_buffers;
+
+void dedup_init(void)
+{
+	int size;
+
+	if (!CFG.dedup_entries)
+		return;
+	entries = calloc(CFG.dedup_entries, sizeof(struct dedup_entry));
+	assert(entries);
+	// The table takes up to half of its slots
+	for (size = 2; size < 2 * (int)CFG.dedup_entries; size *= 2)
+		;
+	index_table = create_pair_table(size);
+}
+
+static void free_reply(struct dedup_entry *e)
+{
+	generic_buffer gb, next_gb;
+
+	for (gb = e->reply.head_buffer; gb; gb = next_gb) {
+		next_gb = get_buffer_next(gb);
+		free_buffer(gb);
+		held_buffers--;
+	}
+	e->reply.head_buffer = NULL;
+	e->reply.tail_buffer = NULL;
+}
+
+static void evict_oldest(void)
+{
+	struct dedup_entry *e = &entries[oldest++ % CFG.dedup_entries];
+
+	// A newer request with the same rid may have taken the key over
+	if (pair_table_lookup(index_table, e->key) == e)
+		pair_table_remove(index_table, e->key);
+	free_reply(e);
+}
+
+static void expire(long now)
+{
+	while (oldest != next &&
+		   now - entries[oldest % CFG.dedup_entries].started_at >
+			   CFG.dedup_ttl)
+		evict_oldest();
+}
+
+int dedup_check(struct r2p2_host_tuple *sender, uint16_t rid, uint32_t epoch)
+{
+	struct dedup_entry *e;
+
+	e = pair_table_lookup(index_table, pair_key(sender->ip, sender->port, rid));
+	if (!e || e->epoch != epoch)
+		return DEDUP_NEW;
+	if (time_us() - e->started_at > CFG.dedup_ttl)
+		return DEDUP_NEW;
+
+	if (!e->replied)
+		return DEDUP_HANDLED;
+	if (!e->reply.head_buffer)
+		return DEDUP_UNCACHED;
+	send_kept_buffers(e->reply.head_buffer, e->resent, sender, NULL);
+	e->resent = 1;
+	return DEDUP_HANDLED;
+}
+
+void dedup_start(struct r2p2_host_tuple *sender, uint16_t rid, uint32_t epoch)
+{
+	struct dedup_entry *e;
+	uint64_t key;
+	long now;
+	int ret;
+
+	now = time_us();
+	expire(now);
+	if (next - oldest == CFG.dedup_entries)
+		evict_oldest();
+
+	key = pair_key(sender->ip, sender->port, rid);
+	e = pair_table_remove(index_table, key);
+	if (e)
+		free_reply(e);
+
+	e = &entries[next++ % CFG.dedup_entries];
+	e->key = key;
+	e->epoch = epoch;
+	e->started_at = now;
+	e->replied = 0;
+	e->resent = 0;
+	ret = pair_table_insert(index_table, key, e);
+	assert(!ret);
+}
+
+void dedup_done(struct r2p2_host_tuple *sender, uint16_t rid, uint32_t epoch,
+				struct r2p2_msg *reply)
+{
+	struct dedup_entry *e;
+	generic_buffer gb, copy;
+	uint32_t count = 0;
+
+	e = pair_table_lookup(index_table, pair_key(sender->ip, sender->port, rid));
+	if (!e || e->epoch != epoch)
+		return;
+
+	/*
+	 * Without buffers for the copy the entry stays replied but empty,
+	 * duplicates get a DROP rather than run twice
+	 */
+	e->replied = 1;
+	for (gb = reply->head_buffer; gb; gb = get_buffer_next(gb))
+		count++;
+	if (held_buffers + count > CFG.dedup_buffers)
+		return;
+	for (gb = reply->head_buffer; gb; gb = get_buffer_next(gb)) {
+		copy = copy_buffer(gb);
+		if (!copy) {
+			free_reply(e);
+			return;
+		}
+		r2p2_msg_add_payload(&e->reply, copy);
+		held_buffers++;
+	}
+}
+
+void dedup_dropped(struct r2p2_host_tuple *sender, uint16_t rid,
+				   uint32_t epoch)
+{
+	struct dedup_entry *e;
+
+	e = pair_table_lookup(index_table, pair_key(sender->ip, sender->port, rid));
+	if (e && e->epoch == epoch)
+		e->replied = 1;
+}
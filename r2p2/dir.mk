@@ -1,4 +1,4 @@
-R2P2_SRC_C = r2p2-common.c mempool.c cfg.c
+R2P2_SRC_C = r2p2-common.c mempool.c pair-table.c timer-wheel.c cfg.c admission.c dedup.c client-lb.c submit.c workers.c
 LINUX_SRC_C = linux-backend.c
 
 ifeq ($(WITH_RAFT), 1)
@@ -562,6 +562,7 @@ static void	send_raft_msg(int to_id, union generic_raft_msg *msg, int msg_type,
 	if (!pair) {
 		ctx = alloc_object(ctx_pool);
 		assert(ctx);
+		r2p2_ctx_init(ctx);
 		ctx->success_cb     = raft_reply_recved,
 		ctx->error_cb       = raft_request_err,
 		ctx->timeout_cb     = raft_request_timeout,
@@ -784,7 +785,7 @@ static int msg_to_entries(msg_entry_t *entries, struct gbuffer_reader *gbr,
 			r2p2_msg_add_payload(&sp->request, new_buffer);
 			payload_left -= get_buffer_payload_size(new_buffer);
 			while(payload_left) {
-				to_copy = min(payload_left, (int)(PAYLOAD_SIZE+sizeof(struct r2p2_header)));
+				to_copy = min(payload_left, (int)(PAYLOAD_SIZE(CFG.mtu)+sizeof(struct r2p2_header)));
 				new_buffer = get_buffer();
 				assert(new_buffer);
 				dst = get_buffer_payload(new_buffer);
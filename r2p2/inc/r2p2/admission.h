@@ -0,0 +1,48 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2019-2021 Ecole Polytechnique Federale Lausanne (EPFL)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+/*
+ * Per-core admission control of incoming requests. A request is rejected
+ * with a DROP_MSG when too many are in flight, when the NIC queue backs up,
+ * or CoDel style while requests wait longer than the target sojourn time
+ * between the poll that took their first packet and reaching the app. The
+ * service time is not part of it. With requests run to completion on the
+ * polling core, they wait behind the rest of their receive burst, and the
+ * NIC queue only shows in the backlog. Configured in the admission section
+ * of the config, everything is admitted by default.
+ */
+#define DEFAULT_ADM_INTERVAL 10000 // us
+
+// Admit a new request, it stays in flight until done
+int admission_admit(void);
+// Count a request rejected for other reasons, e.g. app flow control
+void admission_reject(void);
+// The admitted request that arrived at arrived_at reached the app
+void admission_started(long arrived_at);
+// The admitted request got its reply or went away without one
+void admission_done(void);
+// Admitted requests not replied to yet
+uint32_t admission_inflight(void);
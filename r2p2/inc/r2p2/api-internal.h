@@ -26,19 +26,36 @@
 
 #include <arpa/inet.h>
 #include <r2p2/api.h>
+#include <r2p2/timer-wheel.h>
 #include <stdint.h>
 
 #define PER_MSG_PCK 128
-#define PAYLOAD_SIZE                                                           \
-	(1472 - sizeof(struct r2p2_header)) // 1500 - 20 (IP) - 8 (UDP) - (r2p2_HDR)
+// Max packets of a message, the count travels in the 16 bit p_order
+#define MAX_MSG_PCK 0xFFFF
+// Messages up to this many packets track arrivals without allocating
+#define INLINE_MSG_PCK 256
+// Max packets a single NACK asks for, fits the smallest MTU
+#define MAX_NACK_PCK 256
+#define MIN_MTU 576
+#define DEFAULT_MTU 1500
+#define MAX_MTU 9000
+#define IP_UDP_HDRS 28 // 20 (IP) + 8 (UDP)
+#define PAYLOAD_SIZE(mtu)                                                      \
+	((mtu) - IP_UDP_HDRS - sizeof(struct r2p2_header))
 #define MIN_PAYLOAD_SIZE                                                       \
 	(22 -                                                                      \
 	 sizeof(                                                                   \
 		 struct r2p2_header)) // 64 - 14 (ETH) - 20 (IP) - 8 (UDP ) - r2p2_HDR
 #define F_FLAG 0x80
 #define L_FLAG 0x40
+#define R_FLAG 0x20 // NACK for response packets
+#define E_FLAG 0x10 // eager request, the rest follows without an ACK
+#define X_FLAG 0x08 // request from a client that takes extensions in replies
 #define MAGIC 0xCC
 #define SHOULD_REPLY 0x01
+#define ADMITTED 0x02
+#define DELIVERED 0x04 // the app has it, indexed for cancellation
+#define REPLY_EXTS 0x10 // the request had X_FLAG
 
 enum {
 	REQUEST_MSG = 0,
@@ -49,10 +66,19 @@ enum {
 	RAFT_REQ,
 	RAFT_REP,
 	RAFT_MSG,
+	NACK_MSG,
+	CANCEL_MSG, // the client gave up on the request with the rid
 };
 
 typedef void *generic_buffer;
 
+// Packets of a message received so far
+struct pck_set {
+	uint64_t small[INLINE_MSG_PCK / 64];
+	uint64_t *large; // once a packet is past small, sized to the message
+	uint16_t words;	 // of large
+};
+
 struct __attribute__((__packed__)) r2p2_header {
 	uint8_t magic;
 	uint8_t header_size;
@@ -62,6 +88,22 @@ struct __attribute__((__packed__)) r2p2_header {
 	uint16_t p_order;
 };
 
+/*
+ * Header extensions sit between the fixed header and the payload of first
+ * packets, header_size covers them
+ */
+struct __attribute__((__packed__)) r2p2_ext {
+	uint8_t type;
+	uint8_t len; // of the value that follows
+};
+
+enum {
+	EXT_CREDIT = 1, // uint16_t packets the client may send eagerly
+	EXT_DEADLINE = 2, // uint32_t us left for the request when sent
+	EXT_EPOCH = 3, // uint32_t tells retries from new requests with the rid
+	EXT_LOAD = 4, // uint16_t requests in flight at the server when replying
+};
+
 struct __attribute__((__packed__)) r2p2_feedback {
 	uint16_t rid;
 	uint16_t port;
@@ -80,12 +122,34 @@ struct r2p2_client_pair {
 	struct r2p2_msg reply;
 	uint16_t reply_expected_packets;
 	uint16_t reply_received_packets;
+	struct pck_set reply_arrived;
+	struct wheel_timer gap_timer;
+	uint8_t nacks_sent;
+	uint8_t eager; // sends the rest without waiting for the ACK
+	uint8_t attempts; // retries so far
+	uint16_t request_packets;
+	long last_resend;
+	long sent_at; // the current attempt
+	long deadline_at; // 0 for none
 	struct r2p2_ctx *ctx;
+	struct r2p2_host_tuple *destination;
+	uint8_t lb_target; // 1 + the client_lb target picked, 0 for none
+	/*
+	 * The other copy of a hedged request, while both are in flight or the
+	 * first one is only kept as the handle of the request
+	 */
+	struct r2p2_client_pair *hedge;
+	uint8_t hedge_copy; // the reissued one
+	struct wheel_timer hedge_timer;
 	enum {
 		R2P2_W_ACK,
 		R2P2_W_RESPONSE,
+		R2P2_W_RETRY, // backing off before resending
+		R2P2_W_HEDGE, // out, the hedge copy goes on for the request
 	} state;
-	void *timer;
+	struct wheel_timer timer;
+	uint8_t rid_port; // of the core's client ports, the rid is unique on it
+	uint8_t classic; // sent with r2p2_send_req(), without the opt-in fields
 	void *impl_data; // Used to hold the socket used in linux
 	void (*on_free)(void *impl_data);
 };
@@ -95,19 +159,61 @@ struct r2p2_server_pair {
 	struct r2p2_msg reply;
 	uint16_t request_expected_packets;
 	uint16_t request_received_packets;
-	uint8_t flags;
+	uint16_t request_delivered_packets; // streamed to the app and freed
+	struct pck_set request_arrived;
+	// Reassembly gap while pending, linger time once replied
+	struct wheel_timer gap_timer;
+	uint8_t nacks_sent;
+	long last_resend;
+	uint8_t flags; // of the polling core only
+	uint8_t cancelled; // set by the polling core, workers read it too
 #ifdef ACCELERATED
 	long received_at;
 #endif
-	// Add here fields for garbage collection, e.g. last received
+	long arrived_at; // polled the first packet, the admission sojourn starts
+	long deadline_at; // from the first packet, 0 for none
+	uint32_t epoch; // of a request to deduplicate, 0 for none
+	long last_received;
 };
 
+/*
+ * A multicall sends one request per destination, each under a ctx of its
+ * own that reports back to the multicall instead of the app
+ */
+struct r2p2_multicall;
+
+struct r2p2_multicall_member {
+	struct r2p2_ctx ctx;
+	long handle; // of its request while in flight, 0 otherwise
+	struct r2p2_multicall *mc;
+};
+
+struct r2p2_multicall {
+	struct r2p2_ctx *ctx; // the app's
+	struct r2p2_multicall_member members[R2P2_MAX_MULTICALL];
+	struct r2p2_msg request; // prepared once, until sent to all
+	int n;
+	int k;
+	int sent;
+	int answered;
+	int failed;
+	uint8_t sending; // ending is deferred until the send returns
+	uint8_t ended;
+	long stagger;
+	struct wheel_timer stagger_timer;
+};
+
+// To the ctx error_cb or completion queue
+void notify_error(struct r2p2_ctx *ctx, int err);
+
 static inline int is_response(struct r2p2_header *h)
 {
 	return ((h->type_policy & 0xF0) == (RESPONSE_MSG << 4)) ||
 		((h->type_policy & 0xF0) == (ACK_MSG << 4)) ||
 		((h->type_policy & 0xF0) == (DROP_MSG << 4)) ||
-		((h->type_policy & 0xF0) == (RAFT_REP << 4));
+		((h->type_policy & 0xF0) == (RAFT_REP << 4)) ||
+		(((h->type_policy & 0xF0) == (NACK_MSG << 4)) &&
+		 !(h->flags & R_FLAG));
 }
 
 static inline int is_first(struct r2p2_header *h)
@@ -120,6 +226,16 @@ static inline int is_last(struct r2p2_header *h)
 	return h->flags & L_FLAG;
 }
 
+static inline int is_eager(struct r2p2_header *h)
+{
+	return h->flags & E_FLAG;
+}
+
+static inline int takes_exts(struct r2p2_header *h)
+{
+	return h->flags & X_FLAG;
+}
+
 static inline int is_raft_single_msg(struct r2p2_header *h)
 {
 	return ((h->type_policy & 0xF0) == (RAFT_MSG << 4));
@@ -148,6 +264,21 @@ static inline int is_replicated_req(struct r2p2_header *h)
 		get_policy(h) == REPLICATED_ROUTE_NO_SE);
 }
 
+// Value of the header extension of the given type, NULL if absent
+static inline void *find_ext(struct r2p2_header *h, uint8_t type)
+{
+	struct r2p2_ext *ext = (struct r2p2_ext *)(h + 1);
+	char *end = (char *)h + h->header_size;
+
+	while ((char *)(ext + 1) <= end &&
+		   (char *)(ext + 1) + ext->len <= end) {
+		if (ext->type == type)
+			return ext + 1;
+		ext = (struct r2p2_ext *)((char *)(ext + 1) + ext->len);
+	}
+	return NULL;
+}
+
 /*
  * Generic buffer API
  */
@@ -155,6 +286,9 @@ void free_buffer(generic_buffer buffer);
 
 generic_buffer get_buffer(void);
 
+// All count of them or none, -1
+int get_buffers(generic_buffer *bufs, int count);
+
 void *get_buffer_payload(generic_buffer gb);
 
 uint32_t get_buffer_payload_size(generic_buffer gb);
@@ -188,22 +322,63 @@ void handle_incoming_pck(generic_buffer gb, int len,
 						 struct r2p2_host_tuple *source,
 						 struct r2p2_host_tuple *local_host);
 #endif
-void timer_triggered(struct r2p2_client_pair *cp);
 void forward_request(struct r2p2_server_pair *sp);
+// The request leaves the queues of the core for the app
+void request_started(struct r2p2_server_pair *sp);
+// Run the recv callback on the request, on this thread
+void deliver_request(struct r2p2_server_pair *sp);
+// Drop the request if past its deadline, 1 if it was
+int drop_late_request(struct r2p2_server_pair *sp);
+// Drop the request if the client cancelled it, 1 if it did
+int drop_cancelled_request(struct r2p2_server_pair *sp);
 struct r2p2_server_pair *alloc_server_pair(void);
 void free_server_pair(struct r2p2_server_pair *sp);
 void r2p2_msg_add_payload(struct r2p2_msg *msg, generic_buffer gb);
-void r2p2_prepare_msg(struct r2p2_msg *msg, struct iovec *iov, int iovcnt,
-					  uint8_t req_type, uint8_t policy, uint16_t req_id);
+int r2p2_alloc_msg(struct r2p2_msg *msg, uint32_t len, uint8_t req_type,
+				   uint8_t policy, uint16_t req_id,
+				   struct r2p2_host_tuple *dest);
+int r2p2_prepare_msg(struct r2p2_msg *msg, struct iovec *iov, int iovcnt,
+					 uint8_t req_type, uint8_t policy, uint16_t req_id,
+					 struct r2p2_host_tuple *dest);
 void send_replicated_replies(void);
+/*
+ * Send a chain of buffers that we keep, with resent set if they went out
+ * before. The chain stays ours as it is.
+ */
+void send_kept_buffers(generic_buffer first, int resent,
+					   struct r2p2_host_tuple *dest, void *socket_info);
+// A new buffer with the payload of gb, NULL if there is none left
+generic_buffer copy_buffer(generic_buffer gb);
+void r2p2_run_timers(void);
 
 /*
  * Implementation specific
  */
+/*
+ * A core sends requests from RID_PORTS client ports, the 16-bit rid only
+ * has to be unique per port, so that more than 64k requests are in flight
+ */
+#ifndef RID_PORTS
+#define RID_PORTS 2
+#endif
 int prepare_to_send(struct r2p2_client_pair *cp);
 int buf_list_send(generic_buffer first_buf, struct r2p2_host_tuple *dest,
 				  void *socket_info);
-int disarm_timer(void *timer);
+/*
+ * Send only the given buffers, not their chains, as a single burst. The
+ * buffers are unchained before they are handed over, the caller keeps
+ * their next buffers and chains retained ones back if it needs to.
+ */
+int buf_burst_send(generic_buffer *bufs, struct r2p2_host_tuple **dests,
+				   void **socket_infos, int count);
+/*
+ * Keep the buffer valid after it is sent, until free_buffer(). Don't send
+ * it again as it is, the DPDK send writes into it while an earlier send
+ * may still be queued, see send_kept_buffers().
+ */
+void retain_buffer(generic_buffer gb);
+/* Packets waiting in the receive queue of this core, 0 if unknown */
+int rx_backlog(void);
 void router_notify(uint32_t ip, uint16_t port, uint16_t rid);
 static inline void r2p2_prepare_feedback(char *dest, uint32_t ip,
 		uint16_t port, uint16_t rid)
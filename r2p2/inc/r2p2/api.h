@@ -32,6 +32,8 @@ typedef void (*success_cb_f)(long handle, void *arg, struct iovec *iov,
 typedef void (*error_cb_f)(void *arg, int err);
 typedef void (*timeout_cb_f)(void *arg);
 typedef void (*recv_fn)(long handle, struct iovec *iov, int iovcnt);
+typedef void (*recv_stream_fn)(long handle, struct iovec *iov, int iovcnt,
+							   int last);
 typedef int (*app_flow_control)(void);
 
 struct __attribute__((packed)) r2p2_host_tuple {
@@ -49,20 +51,101 @@ enum {
 enum {
 	ERR_NO_SOCKET=1,
 	ERR_DROP_MSG,
+	ERR_NO_RID,
+	ERR_MSG_SIZE,
+	ERR_MIXED_CQ, // the ctx has only some of the callbacks
 };
 
+/*
+ * Opt-in retries of requests that time out or, with retry_drop, that the
+ * server drops. Retry n waits b = min(base_backoff * 2^(n-1), max_backoff)
+ * shortened by a random share of up to jitter (0 to 1) of b, so that
+ * clients hit by the same overload don't come back in sync. Retries reuse
+ * the request id and buffers, the server may see a request more than once.
+ */
+struct r2p2_retry_policy {
+	int max_attempts; // including the first one
+	long base_backoff; // us
+	long max_backoff; // us
+	double jitter;
+	int retry_drop;
+};
+
+/*
+ * As ctx timeout, time out once the exchange makes no progress for longer
+ * than the smoothed RTT to the destination allows, Jacobson/Karels style
+ */
+#define R2P2_ADAPTIVE_TIMEOUT -1
+
+// Destinations of a multicall at most
+#define R2P2_MAX_MULTICALL 64
+
+/*
+ * r2p2_send_req() reads the fields up to the timestamps only, as it always
+ * did. The opt-in ones after them are for the other send functions, zero
+ * the ctx with r2p2_ctx_init() before filling it in to leave them off.
+ */
 struct __attribute__((packed)) r2p2_ctx {
 	success_cb_f success_cb;
 	error_cb_f error_cb;
 	timeout_cb_f timeout_cb;
 	void *arg;
-	long timeout;
+	long timeout; // us, 0 for none
 	int routing_policy;
 	struct r2p2_host_tuple *destination;
 #ifdef WITH_TIMESTAMPING
 	struct timespec tx_timestamp;
 	struct timespec rx_timestamp;
 #endif
+	struct r2p2_retry_policy *retry; // NULL for no retries
+	long deadline; // us from sending until the reply is useless, 0 for none
+	long hedge_delay; // us before reissuing a 1-packet request, 0: none
+	struct r2p2_host_tuple *hedge_destination; // NULL for destination again
+	long stagger; // us between the sends of a multicall, 0 for at once
+};
+
+/* Per-core server admission counters */
+struct r2p2_admission_stats {
+	uint64_t admitted;
+	uint64_t rejected;
+	uint32_t inflight;
+};
+
+/* Per-core client hedging counters */
+struct r2p2_hedge_stats {
+	uint64_t requests; // sent with a hedge delay
+	uint64_t hedged; // reissued after it
+	uint64_t hedge_wins; // answered first by the reissued one
+};
+
+/*
+ * A ctx without callbacks completes to the per-core completion queue
+ * instead, with its arg as the tag. A ctx has either all three callbacks
+ * or none. Requests with only some of them are not sent, they fail with
+ * ERR_MIXED_CQ through the error_cb if the ctx has one.
+ */
+enum {
+	R2P2_CQ_SUCCESS = 0,
+	R2P2_CQ_TIMEOUT,
+	R2P2_CQ_ERROR,
+	R2P2_CQ_SENT, // a submitted response went out
+};
+
+struct r2p2_cq_entry {
+	void *tag;
+	long handle; // of the reply, for success only
+	int status;
+	int err; // -ERR_* for R2P2_CQ_ERROR
+};
+
+struct r2p2_engine;
+struct r2p2_submitter;
+
+struct r2p2_req_desc {
+	struct iovec *iov;
+	int iovcnt;
+	struct r2p2_ctx *ctx;
+	long handle; // set on sending, as returned by r2p2_send_req_ex
 };
 
 /* Functions called by the application */
@@ -77,7 +160,99 @@ void r2p2_poll(void);
  * Implementation agnostic
  */
 void r2p2_set_recv_cb(recv_fn fn);
+/*
+ * Stop the worker threads of the calling core once they ran the requests
+ * handed to them, and wait for them. The requests still waiting for a
+ * worker, and those that arrive later, run on the calling thread.
+ */
+void r2p2_stop_workers(void);
+/*
+ * Streaming receive: requests reach fn in order as their packets arrive,
+ * over one or more calls with the final one having last set. The iov is
+ * only valid during the call. Respond after the final call. A request
+ * abandoned midway ends with a call without iov and last set to -1.
+ * Streamed requests run on the polling core, not with workers configured.
+ */
+void r2p2_set_recv_stream_cb(recv_stream_fn fn);
 void r2p2_set_app_flow_control_fn(app_flow_control fn);
+void r2p2_get_admission_stats(struct r2p2_admission_stats *stats);
+void r2p2_get_hedge_stats(struct r2p2_hedge_stats *stats);
+void r2p2_ctx_init(struct r2p2_ctx *ctx);
 void r2p2_send_req(struct iovec *iov, int iovcnt, struct r2p2_ctx *ctx);
+/*
+ * As r2p2_send_req(), with the opt-in ctx fields. Returns the handle of the
+ * request for r2p2_cancel_req(), or 0 if it failed. The ctx is told why,
+ * see ERR_MIXED_CQ for one without all of the callbacks. A ctx may have
+ * many requests in flight.
+ */
+long r2p2_send_req_ex(struct iovec *iov, int iovcnt, struct r2p2_ctx *ctx);
+int r2p2_send_req_batch(struct r2p2_req_desc *reqs, int n);
 void r2p2_send_response(long handle, struct iovec *iov, int iovcnt);
+/*
+ * Zero-copy send: reserve fills iov with the writable payload regions of the
+ * already prepared packets and returns their count, or a negative value if
+ * more than iovcnt regions are needed. Commit sends what was reserved.
+ */
+int r2p2_reserve_req(long *handle, int len, struct r2p2_ctx *ctx,
+					 struct iovec *iov, int iovcnt);
+void r2p2_commit_req(long handle);
+int r2p2_reserve_response(long handle, int len, struct iovec *iov,
+						  int iovcnt);
+void r2p2_commit_response(long handle);
 void r2p2_recv_resp_done(long handle);
+/*
+ * Take up to max completions, oldest first. Only r2p2_poll() makes them,
+ * the queue is not polled from here. A reply's payload is read with
+ * r2p2_resp_iovec(), which works like r2p2_reserve_req(), and the handle
+ * is released with r2p2_recv_resp_done().
+ */
+int r2p2_poll_cq(struct r2p2_cq_entry *entries, int max);
+int r2p2_resp_iovec(long handle, struct iovec *iov, int iovcnt);
+/*
+ * Submission from threads other than the one polling. The poller hands
+ * out its engine, any thread then creates a submitter for it, with a
+ * completion ring of size (a power of two) entries. r2p2_poll() picks the
+ * submissions up and completes them to the submitter's ring, where
+ * r2p2_submitter_poll() takes them, tagged with the ctx arg of requests
+ * or the tag of responses. A submitter is used by one thread only. The
+ * ctx is copied, its destinations and the iov have to stay valid until
+ * the completion. Submit calls return -1 while the engine or the
+ * completion ring is full. The reply handles of completed requests are
+ * given back with r2p2_submit_resp_done(). The sizes of the submitters of
+ * an engine add up to 8192 at most, creating one past that returns NULL.
+ * A submitter is destroyed once all of its completions were polled.
+ */
+struct r2p2_engine *r2p2_get_engine(void);
+struct r2p2_submitter *r2p2_submitter_create(struct r2p2_engine *engine,
+											 int size);
+void r2p2_submitter_destroy(struct r2p2_submitter *s);
+int r2p2_submit_req(struct r2p2_submitter *s, struct iovec *iov, int iovcnt,
+					struct r2p2_ctx *ctx);
+int r2p2_submit_response(struct r2p2_submitter *s, long handle,
+						 struct iovec *iov, int iovcnt, void *tag);
+int r2p2_submit_resp_done(struct r2p2_submitter *s, long handle);
+int r2p2_submitter_poll(struct r2p2_submitter *s,
+						struct r2p2_cq_entry *entries, int max);
+/*
+ * Give up on a request in flight, none of its callbacks are called. The
+ * handle is the one of r2p2_send_req_ex() or r2p2_reserve_req(), it is only
+ * valid until a callback of the request ran. The router or server stop
+ * working on it if they still can.
+ */
+void r2p2_cancel_req(long handle);
+// The client cancelled the request, its reply would be dropped. Only with
+// cancel_delivered in the config, 0 otherwise.
+int r2p2_is_cancelled(long handle);
+/*
+ * Partition-aggregate: send the request to n destinations and be done with
+ * the first k replies. Each of them reaches the ctx success_cb with a
+ * handle of its own, the other requests are then cancelled. Once fewer
+ * than k replies are still possible, a single timeout_cb or error_cb ends
+ * it instead. Per request, the ctx settings apply as for r2p2_send_req_ex,
+ * except destination. With a ctx stagger the sends are spread out in time,
+ * so that the replies don't all come back at once. r2p2_cancel_req does
+ * not apply. Returns 0, or -1 if the multicall could not start.
+ */
+int r2p2_send_multicall(struct r2p2_host_tuple **dests, int n,
+						struct iovec *iov, int iovcnt, int k,
+						struct r2p2_ctx *ctx);
@@ -30,6 +30,13 @@
 #endif
 
 #define MAX_MULTICAST_IPS 64
+#define MAX_PATH_MTUS 64
+#define MAX_LB_TARGETS 64
+
+struct path_mtu {
+	uint32_t ip;
+	uint16_t mtu;
+};
 
 struct cfg_parameters {
 	uint32_t host_addr;
@@ -41,8 +48,45 @@ struct cfg_parameters {
 	struct r2p2_raft_peer * raft_peers;
 	uint32_t multicast_ips[MAX_MULTICAST_IPS];
 	uint8_t multicast_cnt;
+	uint16_t mtu;
+	struct path_mtu path_mtus[MAX_PATH_MTUS];
+	uint8_t path_mtu_cnt;
+	uint32_t adm_target; // us, 0 disables the sojourn time control
+	uint32_t adm_interval; // us
+	uint32_t adm_max_inflight; // 0 for no limit
+	uint32_t adm_max_rx_backlog; // packets, 0 for no limit
+	uint32_t dedup_entries; // 0 disables request deduplication
+	uint32_t dedup_ttl; // us
+	uint32_t dedup_buffers; // packets the cached replies hold at most
+	uint8_t cancel_delivered; // index the requests the app has for CANCEL
+	struct r2p2_host_tuple lb_targets[MAX_LB_TARGETS];
+	uint8_t lb_target_cnt; // 0 leaves LB_ROUTE to the router
+	uint8_t lb_policy;
+	uint8_t workers; // per polling core, 0 runs requests on it
+	uint8_t worker_depth; // requests queued or running per worker
 };
 
 struct cfg_parameters CFG;
 
+#define CFG_PATH "/etc/r2p2.conf"
+
+/*
+ * 0 once parsed, 1 without a config file, in which case the defaults
+ * hold, and -1 for a config that is not valid
+ */
 int parse_config(void);
+
+/*
+ * The MTU towards ip, never above the local one since the peer receives
+ * in buffers sized for it. A search of the overrides, r2p2 caches the
+ * result per destination.
+ */
+static inline uint16_t get_path_mtu(uint32_t ip)
+{
+	int i;
+
+	for (i = 0; i < CFG.path_mtu_cnt; i++)
+		if (CFG.path_mtus[i].ip == ip)
+			return CFG.path_mtus[i].mtu;
+	return CFG.mtu;
+}
@@ -0,0 +1,49 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2019-2021 Ecole Polytechnique Federale Lausanne (EPFL)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include <r2p2/api.h>
+
+/*
+ * Load balancing of LB_ROUTE requests in the client, for deployments
+ * without a router. Requests go straight to one of the configured targets,
+ * chosen on the requests this core has outstanding to each of them plus
+ * the queue length hint of their last reply. Configured in the client_lb
+ * section of the config, LB_ROUTE goes through the router by default.
+ */
+enum {
+	CLIENT_LB_P2C = 0, // the better of two random targets
+	CLIENT_LB_JSQ, // the best of all targets
+};
+
+int client_lb_enabled(void);
+// Pick a target for a new request, it counts as outstanding until done
+int client_lb_pick(void);
+struct r2p2_host_tuple *client_lb_target(int target);
+void client_lb_done(int target);
+// The server behind target reported load requests in its queue
+void client_lb_report(int target, uint16_t load);
@@ -0,0 +1,61 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2019-2021 Ecole Polytechnique Federale Lausanne (EPFL)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include <r2p2/api.h>
+
+/*
+ * At-most-once execution of retried requests. Clients with a retry policy
+ * tag each request with an epoch that stays the same across its attempts.
+ * The server remembers the requests handed to the app by sender, rid and
+ * epoch. A duplicate of one still in progress is swallowed, one of a
+ * replied request gets the cached reply without reaching the app. Entries
+ * are evicted oldest first once the cache is full or older than ttl_us.
+ * The cached replies hold at most buffers packets, the duplicates of a
+ * reply that didn't fit get a DROP, as do those of a request freed without
+ * a reply. Configured in the dedup section of the config, off by default.
+ */
+#define DEFAULT_DEDUP_TTL 1000000 // us
+#define DEFAULT_DEDUP_BUFFERS 1024
+
+enum {
+	DEDUP_NEW, // not a duplicate
+	DEDUP_HANDLED, // still in progress, or its cached reply was resent
+	DEDUP_UNCACHED, // replied to, without a cached reply to resend
+};
+
+void dedup_init(void);
+// Resend the reply of a duplicate that was replied to, one of the above
+int dedup_check(struct r2p2_host_tuple *sender, uint16_t rid, uint32_t epoch);
+// The request is handed to the app
+void dedup_start(struct r2p2_host_tuple *sender, uint16_t rid, uint32_t epoch);
+// The reply of the request is about to be sent, keep a copy
+void dedup_done(struct r2p2_host_tuple *sender, uint16_t rid, uint32_t epoch,
+				struct r2p2_msg *reply);
+// The request is freed without a reply, its duplicates get a DROP
+void dedup_dropped(struct r2p2_host_tuple *sender, uint16_t rid,
+				   uint32_t epoch);
@@ -0,0 +1,75 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2019-2021 Ecole Polytechnique Federale Lausanne (EPFL)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+/*
+ * Open-addressing hash table used to index the pending pairs of a core.
+ * Keys are (ip, port, rid) tuples packed in 64 bits, values are the pair
+ * objects allocated from the fixed mempools. Linear probing with
+ * backward-shift deletion, so there are no tombstones to clean up.
+ */
+struct pair_table_entry {
+	uint64_t key;
+	void *obj;
+};
+
+struct pair_table {
+	uint32_t size;
+	uint32_t count;
+	uint32_t shift;
+	struct pair_table_entry entries[];
+};
+
+struct pair_table *create_pair_table(int size);
+int pair_table_insert(struct pair_table *t, uint64_t key, void *obj);
+void *pair_table_remove(struct pair_table *t, uint64_t key);
+
+static inline uint64_t pair_key(uint32_t ip, uint16_t port, uint16_t rid)
+{
+	return ((uint64_t)ip << 32) | ((uint64_t)port << 16) | rid;
+}
+
+static inline uint32_t pair_table_slot(struct pair_table *t, uint64_t key)
+{
+	return (key * 0x9E3779B97F4A7C15UL) >> t->shift;
+}
+
+static inline void *pair_table_lookup(struct pair_table *t, uint64_t key)
+{
+	struct pair_table_entry *e;
+	uint32_t idx;
+
+	idx = pair_table_slot(t, key);
+	while (1) {
+		e = &t->entries[idx];
+		if (!e->obj)
+			return NULL;
+		if (e->key == key)
+			return e->obj;
+		idx = (idx + 1) & (t->size - 1);
+	}
+}
@@ -26,12 +26,14 @@
 
 #include <r2p2/api-internal.h>
 #include <r2p2/api.h>
+#include <r2p2/cfg.h>
 
-#define BUFPOOL_SIZE 1024
+#define BUFPOOL_SIZE 8192
 #define SOCKPOOL_SIZE 128
 #define MAX_EVENTS 128
-#define BUFLEN 2048 //(PAYLOAD_SIZE + sizeof(struct r2p2_header) + sizeof(struct
-					// linux_buf_hdr)) half a page
+// A whole UDP payload for the configured MTU
+#define RECVLEN (CFG.mtu - IP_UDP_HDRS)
+#define BUFLEN (RECVLEN + sizeof(struct linux_buf_hdr))
 
 struct __attribute__((packed)) linux_buf_hdr {
 	uint32_t payload_size;
@@ -42,7 +44,6 @@ struct __attribute__((packed)) linux_buf_hdr {
 
 struct __attribute__((packed)) r2p2_socket {
 	int fd;
-	int tfd;
 	struct r2p2_host_tuple local_host;
 	uint16_t taken;
 	struct r2p2_client_pair *cp;
@@ -0,0 +1,77 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2019-2021 Ecole Polytechnique Federale Lausanne (EPFL)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#pragma once
+
+#include <stdint.h>
+
+/*
+ * Hierarchical timing wheel (Varghese & Lauck) for the per-core request
+ * timers. Timers are embedded in the objects they belong to, so arming and
+ * cancelling never allocate and are O(1). Time is counted in ticks, the
+ * caller decides what a tick is worth.
+ */
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+#define WHEEL_LEVELS 4
+// Timers further away than this wait at the top level for another round
+#define WHEEL_MAX_TICKS ((1ULL << (WHEEL_BITS * WHEEL_LEVELS)) - 1)
+
+struct wheel_timer;
+typedef void (*wheel_timer_fn)(struct wheel_timer *t);
+
+struct wheel_timer {
+	struct wheel_timer *next;
+	struct wheel_timer *prev;
+	uint64_t expires;
+	wheel_timer_fn fn;
+};
+
+struct timer_wheel {
+	uint64_t now; // next tick to be processed
+	uint32_t count;
+	struct wheel_timer slots[WHEEL_LEVELS][WHEEL_SLOTS];
+};
+
+void timer_wheel_init(struct timer_wheel *w, uint64_t now);
+void timer_wheel_arm(struct timer_wheel *w, struct wheel_timer *t,
+					 uint64_t expires, wheel_timer_fn fn);
+void timer_wheel_advance(struct timer_wheel *w, uint64_t now);
+
+static inline int wheel_timer_armed(struct wheel_timer *t)
+{
+	return t->next != NULL;
+}
+
+static inline void timer_wheel_cancel(struct timer_wheel *w,
+									  struct wheel_timer *t)
+{
+	if (!wheel_timer_armed(t))
+		return;
+
+	t->prev->next = t->next;
+	t->next->prev = t->prev;
+	t->next = t->prev = NULL;
+	w->count--;
+}
@@ -24,15 +24,16 @@
 
 #pragma once
 
-#include <sys/time.h>
+#include <time.h>
 
 #define min(a, b) ((a) < (b)) ? (a) : (b)
 
+// Monotonic, the timers and timeouts must not jump with the wall clock
 static inline long time_us(void)
 {
-	struct timeval tv;
-	gettimeofday(&tv, NULL);
-	return (long)tv.tv_sec * 1000000 + (long)tv.tv_usec;
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
 }
 
 #ifdef LINUX
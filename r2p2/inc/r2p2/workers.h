@@ -0,0 +1,52 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2019-2021 Ecole Polytechnique Federale Lausanne (EPFL)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#pragma once
+
+#include <r2p2/api-internal.h>
+
+/*
+ * Dispatcher/worker server mode. The polling core keeps receiving and
+ * reassembling requests, and hands each complete one to one of its worker
+ * threads, which runs the recv callback. A worker's r2p2_send_response()
+ * hands a copy of the reply to the polling core, which sends it. It never
+ * waits for the core, the copies pile up on the heap while the core is
+ * behind, so a worker may reply while the polling thread blocks. A worker
+ * skips the requests cancelled while queued. Dispatching is JBSQ: a
+ * request goes to the worker with the fewest requests queued or running,
+ * none of them takes more than depth, and the rest wait at the dispatcher
+ * in arrival order. An idle worker polls its queue for a while, then
+ * sleeps until the polling core hands it a request. Configured in the
+ * workers section of the config, requests run on the polling core by
+ * default and after r2p2_stop_workers().
+ */
+#define DEFAULT_WORKER_DEPTH 2
+#define MAX_WORKERS 64
+#define MAX_WORKER_DEPTH 64
+
+int workers_init(void);
+void workers_dispatch(struct r2p2_server_pair *sp);
+// Hand the waiting requests to the workers that freed up
+void workers_poll(void);
+int in_worker(void);
+void worker_send_response(long handle, struct iovec *iov, int iovcnt);
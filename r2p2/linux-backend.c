@@ -22,6 +22,7 @@
  * SOFTWARE.
  */
 
+#define _GNU_SOURCE
 #include <arpa/inet.h>
 #include <assert.h>
 #include <fcntl.h>
@@ -31,13 +32,14 @@
 #include <string.h>
 #include <sys/epoll.h>
 #include <sys/socket.h>
-#include <sys/timerfd.h>
 #include <unistd.h>
 
 #include <r2p2/cfg.h>
 #include <r2p2/mempool.h>
 #include <r2p2/r2p2-linux.h>
+#include <r2p2/submit.h>
 #include <r2p2/utils.h>
+#include <r2p2/workers.h>
 #ifdef WITH_TIMESTAMPING
 #include <r2p2/timestamping.h>
 #endif
@@ -49,6 +51,8 @@ static __thread int efd;
 static __thread struct socket_pool sp;
 static __thread struct fixed_mempool *buf_pool;
 
+#define SEND_BURST_SIZE 32 // datagrams per sendmmsg()
+
 #ifdef WITH_TIMESTAMPING
 /*
  * Update tx_timestamp in r2p2_ctx if it's smaller than the current one.
@@ -76,7 +80,7 @@ static void update_tx_timestamp(void *event_arg)
 
 int r2p2_init_per_core(int core_id, int core_count)
 {
-	int ret, i, s, ephemeral_port, tfd;
+	int ret, i, s, ephemeral_port;
 	struct epoll_event event;
 	struct sockaddr_in si_me;
 	struct r2p2_socket *r2p2s;
@@ -149,13 +153,9 @@ int r2p2_init_per_core(int core_id, int core_count)
 			return -1;
 		}
 
-		// Create timerfd
-		tfd = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK);
-
 		r2p2s = &sp.sockets[i];
 
 		r2p2s->fd = s;
-		r2p2s->tfd = tfd;
 		r2p2s->local_host.port = ephemeral_port;
 		r2p2s->local_host.ip = 0; // FIXME: set the ip too
 		r2p2s->taken = 0;
@@ -168,14 +168,6 @@ int r2p2_init_per_core(int core_id, int core_count)
 			perror("epoll_ctl");
 			return -1;
 		}
-		// add timerfd to epoll group
-		event.events = EPOLLIN;
-		event.data.ptr = (void *)&r2p2s->tfd;
-		ret = epoll_ctl(efd, EPOLL_CTL_ADD, tfd, &event);
-		if (ret) {
-			perror("epoll_ctl");
-			return -1;
-		}
 	}
 
 	return 0;
@@ -202,17 +194,6 @@ static struct r2p2_socket *get_socket(void)
 	return res;
 }
 
-static int __disarm_timer(int timerfd)
-{
-	struct itimerspec ts = {0};
-
-	// Disable timer
-	if (timerfd_settime(timerfd, 0, &ts, NULL) < 0)
-		assert(0);
-
-	return 0;
-}
-
 static void free_socket(struct r2p2_socket *s)
 {
 	s->taken = 0;
@@ -223,18 +204,9 @@ static void free_socket(struct r2p2_socket *s)
 static void linux_on_client_pair_free(void *data)
 {
 	struct r2p2_socket *sock = (struct r2p2_socket *)data;
-	__disarm_timer(sock->tfd);
 	free_socket(sock);
 }
 
-static void handle_timer_for_socket(struct r2p2_socket *s)
-{
-	// Disable timer
-	__disarm_timer(s->tfd);
-	if (s->taken)
-		timer_triggered(s->cp);
-}
-
 /*
  * Generic buffer implementation
  */
@@ -245,14 +217,28 @@ generic_buffer get_buffer(void)
 
 	res = alloc_object(buf_pool);
 	if (!res)
-		printf("No buffer available...\n");
-	assert(res);
+		return NULL;
 	bhdr = (struct linux_buf_hdr *)res;
 	bzero(bhdr, sizeof(struct linux_buf_hdr));
 
 	return res;
 }
 
+int get_buffers(generic_buffer *bufs, int count)
+{
+	int i;
+
+	for (i = 0; i < count; i++) {
+		bufs[i] = get_buffer();
+		if (!bufs[i]) {
+			while (i--)
+				free_buffer(bufs[i]);
+			return -1;
+		}
+	}
+	return 0;
+}
+
 void *get_buffer_payload(generic_buffer gb)
 {
 	struct linux_buf_hdr *bhdr = (struct linux_buf_hdr *)gb;
@@ -321,9 +307,14 @@ int r2p2_init(int listen_port)
 	if (ret == -1)
 		return -1;
 
+	ret = parse_config();
+	if (ret < 0)
+		return -1;
 #if defined(WITH_ROUTER) || defined(WITH_TIMESTAMPING)
-	if (parse_config())
+	if (ret) {
+		fprintf(stderr, "No config file %s\n", CFG_PATH);
 		return -1;
+	}
 #endif
 
 #ifdef WITH_ROUTER
@@ -339,7 +330,7 @@ int r2p2_init(int listen_port)
 void r2p2_poll(void)
 {
 	struct epoll_event events[MAX_EVENTS];
-	int ready, i, recvlen, is_timer_event;
+	int ready, i, recvlen;
 	struct r2p2_socket *s;
 	generic_buffer gb;
 	void *buf, *event_arg;
@@ -351,46 +342,43 @@ void r2p2_poll(void)
 	struct sockaddr_in client;
 #endif
 
+	r2p2_run_timers();
+	submit_drain();
+	workers_poll();
+
 	ready = epoll_wait(efd, events, MAX_EVENTS, 0);
 	for (i = 0; i < ready; i++) {
 		event_arg = (struct r2p2_socket *)events[i].data.ptr;
 		assert(event_arg);
 		if (events[i].events & EPOLLIN) {
-			is_timer_event =
-				(unsigned long)event_arg % sizeof(struct r2p2_socket);
-			if (is_timer_event) {
-				assert((unsigned long)event_arg % sizeof(struct r2p2_socket) ==
-					   4);
-				s = container_of(event_arg, struct r2p2_socket, tfd);
-				handle_timer_for_socket(s);
-			} else {
-				// it's a receive event
-				s = container_of(event_arg, struct r2p2_socket, fd);
-
-				gb = get_buffer();
-				assert(gb);
-				buf = get_buffer_payload(gb);
+			s = container_of(event_arg, struct r2p2_socket, fd);
+
+			// Leave the packet queued until buffers are freed
+			gb = get_buffer();
+			if (!gb)
+				break;
+			buf = get_buffer_payload(gb);
 
 #ifdef WITH_TIMESTAMPING
-				recvlen = recv_timestamp(s->fd, &source, buf, &rx_timestamp);
+			recvlen = recv_timestamp(s->fd, &source, buf, &rx_timestamp);
 #else
-				recvlen = recvfrom(s->fd, buf, BUFLEN, 0,
-								   (struct sockaddr *)&client, &slen);
-				source.port = ntohs(client.sin_port);
-				source.ip = ntohl(client.sin_addr.s_addr);
+			// MSG_TRUNC reports packets from peers with a larger MTU
+			recvlen = recvfrom(s->fd, buf, RECVLEN, MSG_TRUNC,
+							   (struct sockaddr *)&client, &slen);
+			source.port = ntohs(client.sin_port);
+			source.ip = ntohl(client.sin_addr.s_addr);
 #endif
-				if (recvlen < 0) {
-					free_buffer(gb);
-					return;
-				}
+			if (recvlen < 0 || recvlen > (int)RECVLEN) {
+				free_buffer(gb);
+				return;
+			}
 
 #ifdef WITH_TIMESTAMPING
-				handle_incoming_pck(gb, recvlen, &source, &s->local_host,
-									&rx_timestamp);
+			handle_incoming_pck(gb, recvlen, &source, &s->local_host,
+								&rx_timestamp);
 #else
-				handle_incoming_pck(gb, recvlen, &source, &s->local_host);
+			handle_incoming_pck(gb, recvlen, &source, &s->local_host);
 #endif
-			}
 		} else if (events[i].events & EPOLLERR) {
 #ifdef WITH_TIMESTAMPING
 			assert((unsigned long)event_arg % sizeof(struct r2p2_socket) == 0);
@@ -411,26 +399,15 @@ void r2p2_poll(void)
 int prepare_to_send(struct r2p2_client_pair *cp)
 {
 	struct r2p2_socket *s;
-	struct itimerspec ts;
-
-	ts.it_interval.tv_sec = 0;
-	ts.it_interval.tv_nsec = 0;
-	ts.it_value.tv_sec = cp->ctx->timeout / 1000000;
-	ts.it_value.tv_nsec = (cp->ctx->timeout % 1000000) * 1000;
 
 	s = get_socket();
 	if (!s) {
-		cp->ctx->error_cb(cp->ctx->arg, -ERR_NO_SOCKET);
+		// The original of a hedge copy is still in flight, it completes
+		if (!cp->hedge_copy)
+			notify_error(cp->ctx, -ERR_NO_SOCKET);
 		return -1;
 	}
 	s->cp = cp;
-	// Arm the timer
-	if (timerfd_settime(s->tfd, 0, &ts, NULL) < 0) {
-		perror("Error setting timer:");
-		assert(0);
-	}
-
-	cp->timer = (void *)(long)s->tfd;
 	cp->request.sender = s->local_host;
 	// FIXME: Should set ip too
 	cp->impl_data = (void *)s;
@@ -439,45 +416,110 @@ int prepare_to_send(struct r2p2_client_pair *cp)
 	return 0;
 }
 
-int buf_list_send(generic_buffer first_buf, struct r2p2_host_tuple *dest,
-				  void *socket_info)
+static inline int socket_fd(void *socket_info)
 {
-	struct sockaddr_in server;
-	socklen_t len = sizeof(server);
-	int sock_fd, buflen, ret;
-	struct r2p2_socket *s;
-	generic_buffer *gb;
-	char *buf;
-
-	if (socket_info) {
-		s = (struct r2p2_socket *)socket_info;
-		sock_fd = s->fd;
-	} else
-		sock_fd = sock.fd;
-
-	server.sin_family = AF_INET;
-	server.sin_port = htons(dest->port);
-	server.sin_addr.s_addr = htonl(dest->ip);
-
-	gb = first_buf;
-	while (gb != NULL) {
-		buf = get_buffer_payload(gb);
-		buflen = get_buffer_payload_size(gb);
-		ret = sendto(sock_fd, buf, buflen, 0, (struct sockaddr *)&server, len);
+	return socket_info ? ((struct r2p2_socket *)socket_info)->fd : sock.fd;
+}
+
+/*
+ * Datagrams to send with one sendmmsg(), the packets of a message or a run
+ * of packets of a burst that leave from the same socket
+ */
+struct send_burst {
+	struct mmsghdr msgs[SEND_BURST_SIZE];
+	struct iovec iovs[SEND_BURST_SIZE];
+	struct sockaddr_in addrs[SEND_BURST_SIZE];
+	int count;
+};
+
+static void burst_add(struct send_burst *b, generic_buffer gb,
+					  struct r2p2_host_tuple *dest)
+{
+	struct sockaddr_in *addr = &b->addrs[b->count];
+	struct iovec *iov = &b->iovs[b->count];
+	struct msghdr *hdr = &b->msgs[b->count].msg_hdr;
+
+	addr->sin_family = AF_INET;
+	addr->sin_port = htons(dest->port);
+	addr->sin_addr.s_addr = htonl(dest->ip);
+	iov->iov_base = get_buffer_payload(gb);
+	iov->iov_len = get_buffer_payload_size(gb);
+	bzero(hdr, sizeof(struct msghdr));
+	hdr->msg_name = addr;
+	hdr->msg_namelen = sizeof(struct sockaddr_in);
+	hdr->msg_iov = iov;
+	hdr->msg_iovlen = 1;
+	b->count++;
+}
+
+static int burst_flush(struct send_burst *b, int sock_fd)
+{
+	int sent, ret;
+
+	for (sent = 0; sent < b->count; sent += ret) {
+		ret = sendmmsg(sock_fd, &b->msgs[sent], b->count - sent, 0);
 		if (ret < 0) {
 			perror("Error sending msg:");
+			b->count = 0;
 			return ret;
 		}
-		gb = get_buffer_next(gb);
 	}
-	ret = 0;
-	return ret;
+	b->count = 0;
+	return 0;
 }
 
-int disarm_timer(void *timer)
+int buf_list_send(generic_buffer first_buf, struct r2p2_host_tuple *dest,
+				  void *socket_info)
 {
-	int tfd = (int)(long)timer;
-	return __disarm_timer(tfd);
+	struct send_burst b;
+	generic_buffer gb;
+	int ret;
+
+	b.count = 0;
+	for (gb = first_buf; gb; gb = get_buffer_next(gb)) {
+		burst_add(&b, gb, dest);
+		if (b.count == SEND_BURST_SIZE) {
+			ret = burst_flush(&b, socket_fd(socket_info));
+			if (ret)
+				return ret;
+		}
+	}
+	return burst_flush(&b, socket_fd(socket_info));
+}
+
+int buf_burst_send(generic_buffer *bufs, struct r2p2_host_tuple **dests,
+				   void **socket_infos, int count)
+{
+	struct send_burst b;
+	int i, ret;
+
+	/*
+	 * Client pairs own their sockets, so the first packets of a batch of
+	 * requests go one per call. The packets resent for a NACK share one.
+	 */
+	b.count = 0;
+	for (i = 0; i < count; i++) {
+		chain_buffers(bufs[i], NULL);
+		burst_add(&b, bufs[i], dests[i]);
+		if (i + 1 == count || b.count == SEND_BURST_SIZE ||
+			socket_fd(socket_infos[i + 1]) != socket_fd(socket_infos[i])) {
+			ret = burst_flush(&b, socket_fd(socket_infos[i]));
+			if (ret)
+				return ret;
+		}
+	}
+	return 0;
+}
+
+void retain_buffer(__attribute__((unused)) generic_buffer gb)
+{
+	// sendto() copies, the buffer is still ours
+}
+
+int rx_backlog(void)
+{
+	// A UDP socket only tells the size of the next datagram
+	return 0;
 }
 
 void router_notify(uint32_t ip, uint16_t port, uint16_t rid)
@@ -0,0 +1,113 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2019-2021 Ecole Polytechnique Federale Lausanne (EPFL)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <r2p2/pair-table.h>
+
+struct pair_table *create_pair_table(int size)
+{
+	struct pair_table *t;
+	uint32_t bits;
+
+	// size must be a power of 2
+	assert(size && !(size & (size - 1)));
+	for (bits = 0; (1U << bits) < (uint32_t)size; bits++)
+		;
+
+	t = malloc(sizeof(struct pair_table) +
+			   size * sizeof(struct pair_table_entry));
+	assert(t);
+	bzero(t->entries, size * sizeof(struct pair_table_entry));
+	t->size = size;
+	t->count = 0;
+	t->shift = 64 - bits;
+
+	return t;
+}
+
+int pair_table_insert(struct pair_table *t, uint64_t key, void *obj)
+{
+	struct pair_table_entry *e;
+	uint32_t idx;
+
+	assert(obj);
+	if (t->count >= t->size / 2)
+		return -1;
+
+	idx = pair_table_slot(t, key);
+	while (1) {
+		e = &t->entries[idx];
+		if (!e->obj)
+			break;
+		if (e->key == key)
+			return -1;
+		idx = (idx + 1) & (t->size - 1);
+	}
+	e->key = key;
+	e->obj = obj;
+	t->count++;
+
+	return 0;
+}
+
+void *pair_table_remove(struct pair_table *t, uint64_t key)
+{
+	struct pair_table_entry *e;
+	uint32_t idx, next, home;
+	void *obj;
+
+	idx = pair_table_slot(t, key);
+	while (1) {
+		e = &t->entries[idx];
+		if (!e->obj)
+			return NULL;
+		if (e->key == key)
+			break;
+		idx = (idx + 1) & (t->size - 1);
+	}
+	obj = e->obj;
+	t->count--;
+
+	/*
+	 * Shift back the following entries of the cluster that would not be
+	 * reachable from their home slot anymore
+	 */
+	next = idx;
+	while (1) {
+		next = (next + 1) & (t->size - 1);
+		if (!t->entries[next].obj)
+			break;
+		home = pair_table_slot(t, t->entries[next].key);
+		if (((next - home) & (t->size - 1)) < ((next - idx) & (t->size - 1)))
+			continue;
+		t->entries[idx] = t->entries[next];
+		idx = next;
+	}
+	t->entries[idx].obj = NULL;
+
+	return obj;
+}
@@ -31,8 +31,16 @@
 #include <string.h>
 #include <time.h>
 
+#include <r2p2/admission.h>
 #include <r2p2/api-internal.h>
+#include <r2p2/cfg.h>
+#include <r2p2/client-lb.h>
+#include <r2p2/dedup.h>
 #include <r2p2/mempool.h>
+#include <r2p2/pair-table.h>
+#include <r2p2/submit.h>
+#include <r2p2/timer-wheel.h>
+#include <r2p2/workers.h>
 #ifdef WITH_RAFT
 #ifdef LINUX
 static_assert(0, "HovercRaft only on DPDK");
@@ -55,54 +63,315 @@ static void set_next_to_lose(void)
 }
 #endif
 #define POOL_SIZE 65536
+// A full pool loads it to 0.25, probes grow fast past that
+#define PAIR_TABLE_SIZE (4 * POOL_SIZE)
+#define RID_SPACE (RID_PORTS * 65536) // the rid and its client port
+#define CLIENT_PAIR_TABLE_SIZE (4 * RID_SPACE)
+#define SEND_BATCH_SIZE 32
+#define MULTICALL_POOL_SIZE 128
+#define CQ_SIZE 1024 // entries, grows if the app falls behind
+#define REASSEMBLY_TIMEOUT 100000 // us
+#define SENDER_SLOTS 4096
+#define MAX_PENDING_PER_SENDER 256
+// Packets incomplete requests may hold, half the Linux buffer pool
+#ifndef REASSEMBLY_MAX_PCK
+#define REASSEMBLY_MAX_PCK 4096
+#endif
+#define REASSEMBLY_GAP 200 // us without progress before sending a NACK
+#define REPLY_LINGER 20000 // us a multi-packet reply is kept for NACKs
+#define NACK_BACKOFF_MAX 6 // the gap doubles with every unanswered NACK
+#define DEST_SETS 64
+#define DEST_WAYS 4
+#define MAX_CREDIT 64 // packets a client may send without waiting for an ACK
+#define CREDIT_TTL 10000 // us an advertised credit stays usable
+#define MIN_RTO 200 // us
+#define MAX_RTO 1000000 // us
+#define INITIAL_RTO 10000 // us, until a destination has an RTT sample
+#ifndef TIMER_TICK_US
+#define TIMER_TICK_US 10
+#endif
 #define min(a, b) ((a) < (b)) ? (a) : (b)
 
 static recv_fn rfn;
+static recv_stream_fn sfn;
 static app_flow_control afc_fn = NULL;
 
 static __thread struct fixed_mempool *client_pairs;
 static __thread struct fixed_mempool *server_pairs;
-static __thread struct fixed_linked_list pending_client_pairs = {0};
+static __thread struct fixed_mempool *multicalls;
+static __thread struct pair_table *pending_client_pairs;
 static __thread struct fixed_linked_list pending_server_pairs = {0};
-static __thread struct iovec to_app_iovec[0xFF];
-static __thread uint16_t rid = 0;
+static __thread struct pair_table *pending_server_index;
+static __thread struct pair_table *lingering_replies;
+// Requests the app is working on, for cancellation
+static __thread struct pair_table *delivered_requests;
+static __thread uint32_t next_epoch;
+static __thread struct r2p2_hedge_stats hedge_stats;
+static __thread struct r2p2_cq_entry *cq;
+static __thread uint32_t cq_size, cq_head, cq_count;
+static __thread struct iovec *to_app_iovec;
+static __thread int to_app_iovec_size;
+static __thread uint32_t rid = 0;
+// The first packets of a batch of requests, allocated in one go
+static __thread generic_buffer *stash;
+static __thread int stashed;
+static __thread uint64_t rid_in_flight[RID_SPACE / 64];
+static __thread struct timer_wheel timers;
+/* Pending reassemblies per sender, hashed on (ip, port) */
+static __thread uint16_t pending_per_sender[SENDER_SLOTS];
+// Packets expected by the pending server pairs
+static __thread uint32_t reassembly_pcks;
+// Packets received in a poll arrived no later than this
+static __thread long polled_at;
+
+/*
+ * What we learnt about the servers we talk to, in DEST_WAYS way sets
+ * hashed on (ip, port)
+ */
+struct dest_info {
+	uint32_t ip;
+	uint16_t port;
+	uint16_t credit;
+	long granted_at;
+	long srtt; // us, 0 without samples
+	long rttvar; // us
+	uint16_t mtu; // of the path, 0 until looked up
+	uint64_t used; // dest_clock at the last lookup, 0 for a free way
+};
+static __thread struct dest_info dests[DEST_SETS][DEST_WAYS];
+static __thread uint64_t dest_clock;
+
+/*
+ * Hand out request ids in a circular order skipping those still in flight,
+ * so that an id is reused as late as possible and never while a response
+ * for it might still be matched. The bits above the 16 of the rid pick the
+ * client port it goes out from.
+ */
+static int alloc_rid(uint32_t *res)
+{
+	uint64_t free_mask;
+	uint32_t word, start, i;
+
+	start = (rid + 1) % RID_SPACE;
+	word = start / 64;
+	// Ignore the ids before the starting point in the first word
+	free_mask = ~rid_in_flight[word] & (~0UL << (start % 64));
+	for (i = 0; i <= RID_SPACE / 64; i++) {
+		if (free_mask) {
+			rid = word * 64 + __builtin_ctzl(free_mask);
+			rid_in_flight[word] |= 1UL << (rid % 64);
+			*res = rid;
+			return 0;
+		}
+		word = (word + 1) % (RID_SPACE / 64);
+		free_mask = ~rid_in_flight[word];
+	}
+	return -1;
+}
+
+static void free_rid(uint32_t id)
+{
+	assert(rid_in_flight[id / 64] & (1UL << (id % 64)));
+	rid_in_flight[id / 64] &= ~(1UL << (id % 64));
+}
+
+static inline int pck_set_words(struct pck_set *s)
+{
+	return s->large ? s->words : INLINE_MSG_PCK / 64;
+}
+
+static inline int pck_set_has(struct pck_set *s, uint16_t idx)
+{
+	uint64_t *words = s->large ? s->large : s->small;
+
+	return idx / 64 < pck_set_words(s) &&
+		   (words[idx / 64] & (1UL << (idx % 64)));
+}
+
+/*
+ * Grows to the expected packets or, before the first packet tells them,
+ * to twice idx. Returns 0 if idx is already in the set, -1 if the set
+ * cannot grow.
+ */
+static int pck_set_grow(struct pck_set *s, uint16_t idx, uint16_t expected)
+{
+	int words = expected ? (expected + 63) / 64 : idx / 32 + 1;
+	uint64_t *large;
+
+	if (words > (MAX_MSG_PCK + 1) / 64)
+		words = (MAX_MSG_PCK + 1) / 64;
+	large = realloc(s->large, words * sizeof(uint64_t));
+	if (!large)
+		return -1;
+	if (!s->large)
+		memcpy(large, s->small, sizeof(s->small));
+	bzero(large + pck_set_words(s),
+		  (words - pck_set_words(s)) * sizeof(uint64_t));
+	s->large = large;
+	s->words = words;
+	return 0;
+}
+
+// Returns -1 if idx is already in the set, -2 if the set cannot grow
+static int pck_set_add(struct pck_set *s, uint16_t idx, uint16_t expected)
+{
+	uint64_t *words;
+
+	if (pck_set_has(s, idx))
+		return -1;
+	if (idx / 64 >= pck_set_words(s) && pck_set_grow(s, idx, expected))
+		return -2;
+	words = s->large ? s->large : s->small;
+	words[idx / 64] |= 1UL << (idx % 64);
+	return 0;
+}
+
+static inline void pck_set_free(struct pck_set *s)
+{
+	free(s->large);
+	s->large = NULL;
+	s->words = 0;
+}
+
+static void free_msg_buffers(struct r2p2_msg *msg)
+{
+	generic_buffer gb, next;
+
+	gb = msg->head_buffer;
+	while (gb != NULL) {
+		next = get_buffer_next(gb);
+		free_buffer(gb);
+		gb = next;
+	}
+	msg->head_buffer = NULL;
+	msg->tail_buffer = NULL;
+}
+
+// A copy of the packet in gb, NULL without a buffer for it
+generic_buffer copy_buffer(generic_buffer gb)
+{
+	generic_buffer copy;
+	uint32_t len;
+
+	copy = get_buffer();
+	if (!copy)
+		return NULL;
+	len = get_buffer_payload_size(gb);
+	memcpy(get_buffer_payload(copy), get_buffer_payload(gb), len);
+	set_buffer_payload_size(copy, len);
+	return copy;
+}
+
+/*
+ * The buffer to send again of a retained one that already went out. On
+ * DPDK the send writes the lower headers into the mbuf, while the earlier
+ * send of it may still be queued, so a copy goes instead.
+ */
+static inline generic_buffer resend_buffer(generic_buffer gb)
+{
+#ifdef LINUX
+	return gb;
+#else
+	return copy_buffer(gb);
+#endif
+}
+
+void send_kept_buffers(generic_buffer first, int resent,
+					   struct r2p2_host_tuple *dest, void *socket_info)
+{
+	generic_buffer gb;
+#ifndef LINUX
+	struct r2p2_msg copies = {0};
+	generic_buffer copy;
+
+	if (resent) {
+		for (gb = first; gb; gb = get_buffer_next(gb)) {
+			copy = copy_buffer(gb);
+			if (!copy) {
+				free_msg_buffers(&copies);
+				return;
+			}
+			r2p2_msg_add_payload(&copies, copy);
+		}
+		buf_list_send(copies.head_buffer, dest, socket_info);
+		return;
+	}
+#endif
+	for (gb = first; gb; gb = get_buffer_next(gb))
+		retain_buffer(gb);
+	buf_list_send(first, dest, socket_info);
+}
 
 static struct r2p2_client_pair *alloc_client_pair(void)
 {
 	struct r2p2_client_pair *cp;
+	uint32_t id;
+
+	if (alloc_rid(&id))
+		return NULL;
 
 	cp = alloc_object(client_pairs);
 	assert(cp);
 
 	bzero(cp, sizeof(struct r2p2_client_pair));
+	cp->request.req_id = id & 0xFFFF;
+	cp->rid_port = id >> 16;
 
 	return cp;
 }
 
+/*
+ * The opt-in ctx fields, left alone for requests sent with r2p2_send_req()
+ * whose ctx may predate them
+ */
+static inline struct r2p2_retry_policy *req_retry(struct r2p2_client_pair *cp)
+{
+	return cp->classic ? NULL : cp->ctx->retry;
+}
+
+static inline long req_deadline(struct r2p2_client_pair *cp)
+{
+	return cp->classic ? 0 : cp->ctx->deadline;
+}
+
+static inline long req_hedge_delay(struct r2p2_client_pair *cp)
+{
+	return cp->classic ? 0 : cp->ctx->hedge_delay;
+}
+
+static inline int reply_complete(struct r2p2_client_pair *cp)
+{
+	return cp->reply_expected_packets &&
+		   cp->reply_received_packets == cp->reply_expected_packets;
+}
+
 static void free_client_pair(struct r2p2_client_pair *cp)
 {
-	generic_buffer gb;
+	// An answered one stopped counting with the reply
+	if (cp->lb_target && !reply_complete(cp))
+		client_lb_done(cp->lb_target - 1);
 
 	// Free the received reply
-	gb = cp->reply.head_buffer;
-	while (gb != NULL) {
-		free_buffer(gb);
-		gb = get_buffer_next(gb);
-	}
+	free_msg_buffers(&cp->reply);
+	pck_set_free(&cp->reply_arrived);
 
-#ifdef LINUX
-	// Free the request sent
-	gb = cp->request.head_buffer;
-	while (gb != NULL) {
-		free_buffer(gb);
-		gb = get_buffer_next(gb);
-	}
-#endif
+	timer_wheel_cancel(&timers, &cp->timer);
+	timer_wheel_cancel(&timers, &cp->gap_timer);
+	timer_wheel_cancel(&timers, &cp->hedge_timer);
+	if (cp->hedge)
+		cp->hedge->hedge = NULL;
+
+	/*
+	 * Free the request sent. On DPDK only the buffers never sent or
+	 * retained for NACKs are still in the chain.
+	 */
+	free_msg_buffers(&cp->request);
 
 	// Free the socket in linux on anything implementation specific
 	if (cp->on_free)
 		cp->on_free(cp->impl_data);
 
+	free_rid((uint32_t)cp->rid_port << 16 | cp->request.req_id);
 	free_object(cp);
 }
 
@@ -118,24 +387,34 @@ struct r2p2_server_pair *alloc_server_pair(void)
 	return sp;
 }
 
+static uint64_t server_pair_key(struct r2p2_server_pair *sp)
+{
+	return pair_key(sp->request.sender.ip, sp->request.sender.port,
+					sp->request.req_id);
+}
+
+// Only the pair holding the key is DELIVERED
+static void forget_delivered(struct r2p2_server_pair *sp)
+{
+	pair_table_remove(delivered_requests, server_pair_key(sp));
+	sp->flags &= ~DELIVERED;
+}
+
 void free_server_pair(struct r2p2_server_pair *sp)
 {
-	generic_buffer gb;
+	timer_wheel_cancel(&timers, &sp->gap_timer);
+	if (sp->flags & ADMITTED)
+		admission_done();
+	if (sp->flags & DELIVERED)
+		forget_delivered(sp);
 
 	// Free the recv message buffers
-	gb = sp->request.head_buffer;
-	while (gb != NULL) {
-		free_buffer(gb);
-		gb = get_buffer_next(gb);
-	}
+	free_msg_buffers(&sp->request);
+	pck_set_free(&sp->request_arrived);
 
 // Free the reply sent
 #ifdef LINUX
-	gb = sp->reply.head_buffer;
-	while (gb != NULL) {
-		free_buffer(gb);
-		gb = get_buffer_next(gb);
-	}
+	free_msg_buffers(&sp->reply);
 #endif
 
 	free_object(sp);
@@ -143,257 +422,1324 @@ void free_server_pair(struct r2p2_server_pair *sp)
 
 static void add_to_pending_client_pairs(struct r2p2_client_pair *cp)
 {
-	struct fixed_obj *fo = get_object_meta(cp);
-	add_to_list(&pending_client_pairs, fo);
+	int ret;
+
+	ret = pair_table_insert(pending_client_pairs,
+							pair_key(cp->request.sender.ip,
+									 cp->request.sender.port,
+									 cp->request.req_id),
+							cp);
+	assert(ret == 0);
 }
 
-static void add_to_pending_server_pairs(struct r2p2_server_pair *sp)
+static inline uint16_t *sender_pending_count(struct r2p2_host_tuple *sender)
 {
-	struct fixed_obj *fo = get_object_meta(sp);
-	add_to_list(&pending_server_pairs, fo);
+	uint64_t h = pair_key(sender->ip, sender->port, 0);
+
+	h *= 0x9E3779B97F4A7C15ULL;
+	return &pending_per_sender[(h >> 32) & (SENDER_SLOTS - 1)];
 }
 
-static void remove_from_pending_server_pairs(struct r2p2_server_pair *sp)
+/*
+ * The entry of dest, NULL if it has none unless claim is set, which
+ * evicts the least recently used one of its set
+ */
+static struct dest_info *dest_info(struct r2p2_host_tuple *dest, int claim)
 {
-	struct fixed_obj *fo = get_object_meta(sp);
-	remove_from_list(&pending_server_pairs, fo);
+	struct dest_info *set, *di, *victim;
+	uint64_t h = pair_key(dest->ip, dest->port, 0);
+	int i;
+
+	h *= 0x9E3779B97F4A7C15ULL;
+	set = dests[(h >> 32) & (DEST_SETS - 1)];
+	victim = &set[0];
+	for (i = 0; i < DEST_WAYS; i++) {
+		di = &set[i];
+		if (di->used && di->ip == dest->ip && di->port == dest->port) {
+			di->used = ++dest_clock;
+			return di;
+		}
+		if (di->used < victim->used)
+			victim = di;
+	}
+	if (!claim)
+		return NULL;
+	bzero(victim, sizeof(struct dest_info));
+	victim->ip = dest->ip;
+	victim->port = dest->port;
+	victim->used = ++dest_clock;
+	return victim;
 }
 
-static void remove_from_pending_client_pairs(struct r2p2_client_pair *cp)
+// The MTU towards dest, the config overrides are searched once
+static uint16_t dest_mtu(struct r2p2_host_tuple *dest)
 {
-	struct fixed_obj *fo = get_object_meta(cp);
-	remove_from_list(&pending_client_pairs, fo);
+	struct dest_info *di;
+
+	if (!CFG.path_mtu_cnt)
+		return CFG.mtu;
+	di = dest_info(dest, 1);
+	if (!di->mtu)
+		di->mtu = get_path_mtu(dest->ip);
+	return di->mtu;
 }
 
-static struct r2p2_server_pair *
-find_in_pending_server_pairs(uint16_t req_id, struct r2p2_host_tuple *sender)
+/*
+ * Credit based eager sending. Servers advertise in every response how many
+ * packets a client may send without waiting for the ACK of the first one.
+ * Clients spend it on multi-packet requests and fall back to REQ0/ACK once
+ * it runs out, goes stale, or when the router picks the server.
+ */
+static int take_credit(struct r2p2_host_tuple *dest, unsigned int pcks)
 {
-	struct r2p2_server_pair *sp;
-	struct fixed_obj *fo;
+	struct dest_info *di = dest_info(dest, 0);
 
-	fo = pending_server_pairs.head;
-	while (fo) {
-		sp = (struct r2p2_server_pair *)fo->elem;
-		if ((sp->request.sender.ip == sender->ip) &&
-			(sp->request.sender.port == sender->port) &&
-			(sp->request.req_id == req_id))
-			return sp;
-		fo = (struct fixed_obj *)fo->next;
-	}
-	return NULL;
+	if (!di || di->credit < pcks || time_us() - di->granted_at > CREDIT_TTL)
+		return 0;
+	di->credit -= pcks;
+	return 1;
 }
 
-static struct r2p2_client_pair *
-find_in_pending_client_pairs(uint16_t req_id, struct r2p2_host_tuple *sender)
+static void grant_credit(struct r2p2_host_tuple *dest, uint16_t credit)
 {
-	struct r2p2_client_pair *cp;
-	struct fixed_obj *fo;
+	struct dest_info *di = dest_info(dest, 1);
 
-	fo = pending_client_pairs.head;
-	// FIXME: inlcude ip too
-	while (fo) {
-		cp = (struct r2p2_client_pair *)fo->elem;
-		if ((cp->request.sender.port == sender->port) &&
-			(cp->request.req_id == req_id))
-			return cp;
-		fo = (struct fixed_obj *)fo->next;
-	}
-	printf("Request not found\n");
-	return NULL;
+	di->credit = credit;
+	di->granted_at = time_us();
 }
 
-
-static int prepare_to_app_iovec(struct r2p2_msg *msg)
+/*
+ * Adaptive timeouts, Jacobson/Karels as in RFC 6298. The first reply packet
+ * of requests that were never retried gives an RTT sample for their
+ * destination. Servers take longer for larger requests, so both the samples
+ * and the timeouts are per request packet.
+ */
+static void rtt_sample(struct r2p2_host_tuple *dest, long rtt)
 {
-	generic_buffer gb;
-	char *buf;
-	int len, iovcnt = 0;
+	struct dest_info *di = dest_info(dest, 1);
 
-	gb = msg->head_buffer;
-	assert(gb);
-	while (gb != NULL) {
-		buf = get_buffer_payload(gb);
-		assert(buf);
-		len = get_buffer_payload_size(gb);
-		to_app_iovec[iovcnt].iov_base = ((struct r2p2_header *)buf) + 1;
-		to_app_iovec[iovcnt++].iov_len = len - sizeof(struct r2p2_header);
-		gb = get_buffer_next(gb);
-		assert(iovcnt < 0xFF);
+	if (rtt < 1)
+		rtt = 1;
+	if (!di->srtt) {
+		di->srtt = rtt;
+		di->rttvar = rtt / 2;
+		return;
 	}
-	return iovcnt;
+	di->rttvar = (3 * di->rttvar + labs(di->srtt - rtt)) / 4;
+	di->srtt = (7 * di->srtt + rtt) / 8;
 }
 
-static void handle_drop_msg(struct r2p2_client_pair *cp)
+static long rto(struct r2p2_host_tuple *dest)
 {
-	cp->ctx->error_cb(cp->ctx->arg, -ERR_DROP_MSG);
-
-	remove_from_pending_client_pairs(cp);
-	free_client_pair(cp);
+	struct dest_info *di = dest_info(dest, 0);
+	long var, res;
+
+	if (!di || !di->srtt)
+		return INITIAL_RTO;
+	// Not below the clock granularity
+	var = 4 * di->rttvar;
+	if (var < TIMER_TICK_US)
+		var = TIMER_TICK_US;
+	res = di->srtt + var;
+	if (res < MIN_RTO)
+		return MIN_RTO;
+	return res > MAX_RTO ? MAX_RTO : res;
 }
 
-void forward_request(struct r2p2_server_pair *sp)
+/*
+ * Timeout of the current attempt, adaptive ones double with every retry.
+ * 0 for none, the request then waits for its reply or a DROP.
+ */
+static long req_timeout(struct r2p2_client_pair *cp)
 {
-	int iovcnt;
+	long res;
 
-	iovcnt = prepare_to_app_iovec(&sp->request);
-	rfn((long)sp, to_app_iovec, iovcnt);
+	if (cp->ctx->timeout != R2P2_ADAPTIVE_TIMEOUT)
+		return cp->ctx->timeout;
+	res = rto(cp->destination) * cp->request_packets;
+	res <<= min(cp->attempts, 16);
+	return res > MAX_RTO ? MAX_RTO : res;
 }
 
-void r2p2_msg_add_payload(struct r2p2_msg *msg, generic_buffer gb)
+// Only while there is room for more reassemblies than are pending
+static inline uint16_t receive_credit(void)
 {
-	if (msg->tail_buffer) {
-		chain_buffers(msg->tail_buffer, gb);
-		msg->tail_buffer = gb;
-	} else {
-		assert(msg->head_buffer == NULL);
-		assert(msg->tail_buffer == NULL);
-		msg->head_buffer = gb;
-		msg->tail_buffer = gb;
-	}
+	return server_pairs->count > server_pairs->size / 2 ? 0 : MAX_CREDIT;
 }
 
-void r2p2_prepare_msg(struct r2p2_msg *msg, struct iovec *iov, int iovcnt,
-					  uint8_t req_type, uint8_t policy, uint16_t req_id)
+static void add_to_pending_server_pairs(struct r2p2_server_pair *sp)
 {
-	unsigned int iov_idx, buffer_cnt, total_payload, single_packet_msg,
-				 is_first, should_small_first;
-	int i, bufferleft, copied, tocopy;
-	struct r2p2_header *r2p2h;
-	generic_buffer gb, new_gb;
-	char *target, *src;
-
-	msg->req_id = req_id;
-	// Fix endianness for the header
-	req_id = htons(req_id);
+	struct fixed_obj *fo = get_object_meta(sp);
+	int ret;
+
+	ret = pair_table_insert(pending_server_index,
+							pair_key(sp->request.sender.ip,
+									 sp->request.sender.port,
+									 sp->request.req_id),
+							sp);
+	assert(ret == 0);
+	add_to_list(&pending_server_pairs, fo);
+	(*sender_pending_count(&sp->request.sender))++;
+	reassembly_pcks += sp->request_expected_packets;
+	sp->last_received = time_us();
+}
 
-	// Check if single or multi-packet msg
-	total_payload = 0;
-	single_packet_msg = 1;
-	for (i=0; i<iovcnt; i++) {
-		total_payload += iov[i].iov_len;
-		if (total_payload > PAYLOAD_SIZE) {
-			single_packet_msg = 0;
-			break;
-		}
-	}
+static void remove_from_pending_server_pairs(struct r2p2_server_pair *sp)
+{
+	struct fixed_obj *fo = get_object_meta(sp);
 
-	if (!single_packet_msg && (req_type == REQUEST_MSG))
-		should_small_first = 1;
-	else
-		should_small_first = 0;
+	pair_table_remove(pending_server_index,
+					  pair_key(sp->request.sender.ip, sp->request.sender.port,
+							   sp->request.req_id));
+	remove_from_list(&pending_server_pairs, fo);
+	(*sender_pending_count(&sp->request.sender))--;
+	reassembly_pcks -= sp->request_expected_packets;
+	timer_wheel_cancel(&timers, &sp->gap_timer);
+}
 
-	iov_idx = 0;
-	bufferleft = 0;
-	copied = 0;
-	gb = NULL;
-	buffer_cnt = 0;
-	is_first = 1;
-	while (iov_idx < (unsigned int)iovcnt) {
-		if (!bufferleft) {
-			// Set the last buffer to full size
-			if (gb) {
-				if (is_first && should_small_first) {
-					set_buffer_payload_size(gb, MIN_PAYLOAD_SIZE +
-													sizeof(struct r2p2_header));
-					is_first = 0;
-				} else
-					set_buffer_payload_size(gb, PAYLOAD_SIZE +
-													sizeof(struct r2p2_header));
-			}
-			new_gb = get_buffer();
-			assert(new_gb);
-			r2p2_msg_add_payload(msg, new_gb);
-			gb = new_gb;
-			target = get_buffer_payload(gb);
-			if (is_first && should_small_first)
-				bufferleft = MIN_PAYLOAD_SIZE;
-			else
-				bufferleft = PAYLOAD_SIZE;
-			// FIX the header
-			r2p2h = (struct r2p2_header *)target;
-			bzero(r2p2h, sizeof(struct r2p2_header));
-			r2p2h->magic = MAGIC;
-			r2p2h->rid = req_id;
-			r2p2h->header_size = sizeof(struct r2p2_header);
-			r2p2h->type_policy = (req_type << 4) | (0x0F & policy);
-			r2p2h->p_order = htons(buffer_cnt++);
-			r2p2h->flags = 0;
-			target += sizeof(struct r2p2_header);
-		}
-		src = iov[iov_idx].iov_base;
-		tocopy = min(bufferleft, (int)(iov[iov_idx].iov_len - copied));
-		memcpy(target, &src[copied], tocopy);
-		copied += tocopy;
-		bufferleft -= tocopy;
-		target += tocopy;
-		if (copied == (int)iov[iov_idx].iov_len) {
-			iov_idx++;
-			copied = 0;
-		}
-	}
+static void arm_timer(struct wheel_timer *t, long timeout, wheel_timer_fn fn)
+{
+	timer_wheel_arm(&timers, t,
+					(time_us() + timeout + TIMER_TICK_US - 1) / TIMER_TICK_US,
+					fn);
+}
 
-	// Set the len of the last buffer
-	set_buffer_payload_size(gb, PAYLOAD_SIZE + sizeof(struct r2p2_header) -
-									bufferleft);
+/*
+ * Selective retransmission. The receiver of a multi-packet message that
+ * stops making progress sends a NACK with the missing packet indices. The
+ * sender keeps the buffers of the message to resend them: the client until
+ * the pair is freed, the server for REPLY_LINGER after replying.
+ */
+// Index of a packet we sent, its header is still in network order
+static inline uint16_t sent_pck_index(generic_buffer gb)
+{
+	struct r2p2_header *h = get_buffer_payload(gb);
 
-	// Fix the header of the first and last packet
-	r2p2h = (struct r2p2_header *)get_buffer_payload(msg->head_buffer);
-	r2p2h->flags |= F_FLAG;
-	r2p2h->p_order = htons(buffer_cnt);
-	r2p2h = (struct r2p2_header *)get_buffer_payload(msg->tail_buffer);
-	r2p2h->flags |= L_FLAG;
+	return is_first(h) ? 0 : ntohs(h->p_order);
 }
 
-static int should_keep_req(__attribute__((unused))struct r2p2_server_pair *sp)
+// The first MAX_NACK_PCK holes, later NACKs ask for the rest
+static int missing_packets(struct pck_set *arrived, uint16_t expected,
+						   uint16_t *missing)
 {
-	if (afc_fn)
-		return afc_fn();
-	else
-		return 1;
+	uint64_t *words = arrived->large ? arrived->large : arrived->small;
+	int i, count = 0, limit = expected;
+
+	// Without the first packet, ask for the holes up to the highest seen
+	if (!limit)
+		for (i = pck_set_words(arrived) - 1; i >= 0; i--)
+			if (words[i]) {
+				limit = i * 64 + 64 - __builtin_clzl(words[i]);
+				break;
+			}
+
+	for (i = 0; i < limit && count < MAX_NACK_PCK; i++)
+		if (!pck_set_has(arrived, i))
+			missing[count++] = htons(i);
+
+	return count;
 }
 
-static void send_drop_msg(struct r2p2_server_pair *sp)
+static void send_nack(uint16_t req_id, uint16_t *missing, int count,
+					  int for_reply, struct r2p2_host_tuple *dest,
+					  void *socket_info)
 {
-	char drop_payload[] = "DROP";
-	struct iovec ack;
-	struct r2p2_msg drop_msg = {0};
+	struct r2p2_msg nack_msg = {0};
+	struct r2p2_header *r2p2h;
+	struct iovec nack;
 
-	ack.iov_base = drop_payload;
-	ack.iov_len = 4;
-	r2p2_prepare_msg(&drop_msg, &ack, 1, DROP_MSG, FIXED_ROUTE,
-			sp->request.req_id);
-	buf_list_send(drop_msg.head_buffer, &sp->request.sender, NULL);
+	nack.iov_base = missing;
+	nack.iov_len = count * sizeof(uint16_t);
+	if (r2p2_prepare_msg(&nack_msg, &nack, 1, NACK_MSG, FIXED_ROUTE, req_id,
+						 dest))
+		return;
+	if (for_reply) {
+		r2p2h = get_buffer_payload(nack_msg.head_buffer);
+		r2p2h->flags |= R_FLAG;
+	}
+	buf_list_send(nack_msg.head_buffer, dest, socket_info);
 #ifdef LINUX
-	free_buffer(drop_msg.head_buffer);
+	free_buffer(nack_msg.head_buffer);
 #endif
 }
 
-static void handle_response(generic_buffer gb, int len,
-							struct r2p2_header *r2p2h,
-							struct r2p2_host_tuple *source,
-#ifdef WITH_TIMESTAMPING
-							struct r2p2_host_tuple *local_host,
-							const struct timespec *last_rx_timestamp)
-#else
-							struct r2p2_host_tuple *local_host)
-#endif
+static inline long nack_gap(uint8_t nacks_sent)
 {
-	struct r2p2_client_pair *cp;
-	int iovcnt;
-	generic_buffer rest_to_send;
+	return REASSEMBLY_GAP << (min(nacks_sent, NACK_BACKOFF_MAX));
+}
 
-	cp = find_in_pending_client_pairs(r2p2h->rid, local_host);
-	if (!cp) {
-		// printf("Expired timer?\n");
-		free_buffer(gb);
+/*
+ * Resend the packets of msg listed in a NACK, both are sorted by index.
+ * NACKs that queued up while we were not polling ask for the same packets,
+ * so only one per gap is served.
+ */
+static void resend_packets(struct r2p2_msg *msg, long *last_resend,
+						   struct r2p2_header *nack, int len,
+						   struct r2p2_host_tuple *dest, void *socket_info)
+{
+	generic_buffer bufs[MAX_NACK_PCK], gb;
+#ifdef LINUX
+	generic_buffer nexts[MAX_NACK_PCK];
+#endif
+	struct r2p2_host_tuple *dests[MAX_NACK_PCK];
+	void *socket_infos[MAX_NACK_PCK];
+	uint16_t *missing, idx;
+	int i, count, n = 0;
+	long now;
+
+	now = time_us();
+	if (now - *last_resend < REASSEMBLY_GAP)
 		return;
-	}
+	*last_resend = now;
 
-#ifdef WITH_TIMESTAMPING
-	// Update ctx rx_timestamp if bigger than the current one.
-	if (last_rx_timestamp != NULL && last_rx_timestamp->tv_sec != 0 &&
-		is_smaller_than(&cp->ctx->rx_timestamp, last_rx_timestamp)) {
-		cp->ctx->rx_timestamp = *last_rx_timestamp;
+	missing = (uint16_t *)((char *)nack + nack->header_size);
+	count = (len - nack->header_size) / sizeof(uint16_t);
+
+	gb = msg->head_buffer;
+	for (i = 0; i < count && gb && n < MAX_NACK_PCK;) {
+		idx = sent_pck_index(gb);
+		if (idx < ntohs(missing[i])) {
+			gb = get_buffer_next(gb);
+			continue;
+		}
+		if (idx == ntohs(missing[i])) {
+			bufs[n] = resend_buffer(gb);
+#ifdef LINUX
+			nexts[n] = get_buffer_next(gb);
+#endif
+			dests[n] = dest;
+			socket_infos[n] = socket_info;
+			n += bufs[n] != NULL;
+		}
+		i++;
+	}
+	if (!n)
+		return;
+	buf_burst_send(bufs, dests, socket_infos, n);
+#ifdef LINUX
+	// Sent as they are, the buffers are still ours to chain back
+	for (i = 0; i < n; i++)
+		chain_buffers(bufs[i], nexts[i]);
+#endif
+}
+
+static void reply_gap_expired(struct wheel_timer *t)
+{
+	struct r2p2_client_pair *cp;
+	uint16_t missing[MAX_NACK_PCK];
+	int count;
+
+	cp = container_of(t, struct r2p2_client_pair, gap_timer);
+	count = missing_packets(&cp->reply_arrived, cp->reply_expected_packets,
+							missing);
+	send_nack(cp->request.req_id, missing, count, 1, &cp->reply.sender,
+			  cp->impl_data);
+	arm_timer(&cp->gap_timer, nack_gap(++cp->nacks_sent), reply_gap_expired);
+}
+
+static void request_gap_expired(struct wheel_timer *t)
+{
+	struct r2p2_server_pair *sp;
+	uint16_t missing[MAX_NACK_PCK];
+	int count;
+
+	sp = container_of(t, struct r2p2_server_pair, gap_timer);
+	count = missing_packets(&sp->request_arrived,
+							sp->request_expected_packets, missing);
+	send_nack(sp->request.req_id, missing, count, 0, &sp->request.sender,
+			  NULL);
+	arm_timer(&sp->gap_timer, nack_gap(++sp->nacks_sent),
+			  request_gap_expired);
+}
+
+static void free_lingering_reply(struct r2p2_server_pair *sp)
+{
+	pair_table_remove(lingering_replies,
+					  pair_key(sp->request.sender.ip, sp->request.sender.port,
+							   sp->request.req_id));
+#ifndef LINUX
+	// Retained on send
+	free_msg_buffers(&sp->reply);
+#endif
+	free_server_pair(sp);
+}
+
+static void reply_linger_expired(struct wheel_timer *t)
+{
+	free_lingering_reply(container_of(t, struct r2p2_server_pair, gap_timer));
+}
+
+/*
+ * Keep a reply that is about to be sent. Skipped when the pairs pool runs
+ * low, lingering replies should not cause new requests to be dropped.
+ */
+static int linger_reply(struct r2p2_server_pair *sp)
+{
+	generic_buffer gb;
+
+	if (server_pairs->count > server_pairs->size / 2)
+		return -1;
+	if (pair_table_insert(lingering_replies,
+						  pair_key(sp->request.sender.ip,
+								   sp->request.sender.port,
+								   sp->request.req_id),
+						  sp))
+		return -1;
+
+	for (gb = sp->reply.head_buffer; gb; gb = get_buffer_next(gb))
+		retain_buffer(gb);
+	free_msg_buffers(&sp->request);
+	arm_timer(&sp->gap_timer, REPLY_LINGER, reply_linger_expired);
+
+	return 0;
+}
+
+/*
+ * The pending list is kept in order of last activity, so move the pair to
+ * the tail whenever a new packet arrives for it.
+ */
+static void touch_pending_server_pair(struct r2p2_server_pair *sp)
+{
+	struct fixed_obj *fo = get_object_meta(sp);
+
+	remove_from_list(&pending_server_pairs, fo);
+	add_to_list(&pending_server_pairs, fo);
+	sp->last_received = time_us();
+	if (wheel_timer_armed(&sp->gap_timer)) {
+		timer_wheel_cancel(&timers, &sp->gap_timer);
+		sp->nacks_sent = 0;
+		arm_timer(&sp->gap_timer, REASSEMBLY_GAP, request_gap_expired);
+	}
+}
+
+// Drop an incomplete request, telling the app if it has seen part of it
+static void drop_pending_server_pair(struct r2p2_server_pair *sp)
+{
+	if (sp->request_delivered_packets)
+		sfn((long)sp, NULL, 0, -1);
+	remove_from_pending_server_pairs(sp);
+	free_server_pair(sp);
+}
+
+/*
+ * Drop reassemblies that have not seen a packet for REASSEMBLY_TIMEOUT.
+ * The clients time out on their own, nothing is sent back.
+ */
+static void expire_pending_server_pairs(long now)
+{
+	struct fixed_obj *fo;
+	struct r2p2_server_pair *sp;
+
+	fo = peek_from_list(&pending_server_pairs);
+	while (fo) {
+		sp = (struct r2p2_server_pair *)fo->elem;
+		if (now - sp->last_received < REASSEMBLY_TIMEOUT)
+			break;
+		drop_pending_server_pair(sp);
+		fo = peek_from_list(&pending_server_pairs);
+	}
+}
+
+static void remove_from_pending_client_pairs(struct r2p2_client_pair *cp)
+{
+	pair_table_remove(pending_client_pairs,
+					  pair_key(cp->request.sender.ip, cp->request.sender.port,
+							   cp->request.req_id));
+}
+
+static struct r2p2_server_pair *
+find_in_pending_server_pairs(uint16_t req_id, struct r2p2_host_tuple *sender)
+{
+	return pair_table_lookup(pending_server_index,
+							 pair_key(sender->ip, sender->port, req_id));
+}
+
+static struct r2p2_client_pair *
+find_in_pending_client_pairs(uint16_t req_id, struct r2p2_host_tuple *sender)
+{
+	return pair_table_lookup(pending_client_pairs,
+							 pair_key(sender->ip, sender->port, req_id));
+}
+
+
+// Payload of a packet, past the header and its extensions
+static inline char *pck_payload(generic_buffer gb)
+{
+	struct r2p2_header *h = get_buffer_payload(gb);
+
+	return (char *)h + h->header_size;
+}
+
+static inline int pck_payload_size(generic_buffer gb)
+{
+	struct r2p2_header *h = get_buffer_payload(gb);
+
+	return get_buffer_payload_size(gb) - h->header_size;
+}
+
+/*
+ * Fill iov with the payload regions of the msg buffers
+ */
+static int r2p2_msg_iovec(struct r2p2_msg *msg, struct iovec *iov,
+						  int max_iovcnt)
+{
+	generic_buffer gb;
+	int iovcnt = 0;
+
+	gb = msg->head_buffer;
+	assert(gb);
+	while (gb != NULL) {
+		if (iovcnt == max_iovcnt)
+			return -1;
+		iov[iovcnt].iov_base = pck_payload(gb);
+		iov[iovcnt++].iov_len = pck_payload_size(gb);
+		gb = get_buffer_next(gb);
+	}
+	return iovcnt;
+}
+
+/*
+ * The completion queue is a ring of entries in completion order. Nothing
+ * may be lost, so a full ring doubles.
+ */
+static void cq_push(void *tag, long handle, int status, int err)
+{
+	struct r2p2_cq_entry *bigger, *e;
+	uint32_t i;
+
+	if (cq_count == cq_size) {
+		bigger = malloc(2 * cq_size * sizeof(struct r2p2_cq_entry));
+		assert(bigger);
+		for (i = 0; i < cq_count; i++)
+			bigger[i] = cq[(cq_head + i) & (cq_size - 1)];
+		free(cq);
+		cq = bigger;
+		cq_head = 0;
+		cq_size *= 2;
+	}
+	e = &cq[(cq_head + cq_count++) & (cq_size - 1)];
+	e->tag = tag;
+	e->handle = handle;
+	e->status = status;
+	e->err = err;
+}
+
+/*
+ * A ctx completes through all three of its callbacks or, without any, to
+ * the CQ. One with only some of them is rejected by arm_req().
+ */
+static inline int uses_cq(struct r2p2_ctx *ctx)
+{
+	return !ctx->success_cb && !ctx->error_cb && !ctx->timeout_cb;
+}
+
+static inline int mixes_cq(struct r2p2_ctx *ctx)
+{
+	return !uses_cq(ctx) &&
+		   (!ctx->success_cb || !ctx->error_cb || !ctx->timeout_cb);
+}
+
+void notify_error(struct r2p2_ctx *ctx, int err)
+{
+	if (uses_cq(ctx))
+		cq_push(ctx->arg, 0, R2P2_CQ_ERROR, err);
+	// One with only some of the callbacks, through its error_cb if any
+	else if (ctx->error_cb)
+		ctx->error_cb(ctx->arg, err);
+}
+
+static void notify_timeout(struct r2p2_ctx *ctx)
+{
+	if (uses_cq(ctx))
+		cq_push(ctx->arg, 0, R2P2_CQ_TIMEOUT, 0);
+	else
+		ctx->timeout_cb(ctx->arg);
+}
+
+// Large messages grow the iovec for good, the next ones are likely large too
+static void grow_app_iovec(int count)
+{
+	int size = to_app_iovec_size;
+
+	if (count <= size)
+		return;
+	// Worker threads start without one
+	if (!size)
+		size = INLINE_MSG_PCK;
+	while (size < count)
+		size *= 2;
+	to_app_iovec = realloc(to_app_iovec, size * sizeof(struct iovec));
+	assert(to_app_iovec);
+	to_app_iovec_size = size;
+}
+
+static int prepare_to_app_iovec(struct r2p2_msg *msg)
+{
+	generic_buffer gb;
+	int iovcnt, count = 0;
+
+	iovcnt = r2p2_msg_iovec(msg, to_app_iovec, to_app_iovec_size);
+	if (iovcnt < 0) {
+		for (gb = msg->head_buffer; gb; gb = get_buffer_next(gb))
+			count++;
+		grow_app_iovec(count);
+		iovcnt = r2p2_msg_iovec(msg, to_app_iovec, to_app_iovec_size);
+	}
+	assert(iovcnt > 0);
+	return iovcnt;
+}
+
+/*
+ * The app gets the request, index it for cancellation if configured. A
+ * newer request with the same rid takes the key over.
+ */
+static void hand_to_app(struct r2p2_server_pair *sp)
+{
+	struct r2p2_server_pair *old;
+
+	if (sp->epoch)
+		dedup_start(&sp->request.sender, sp->request.req_id, sp->epoch);
+	if (!CFG.cancel_delivered)
+		return;
+	old = pair_table_remove(delivered_requests, server_pair_key(sp));
+	if (old)
+		old->flags &= ~DELIVERED;
+	if (!pair_table_insert(delivered_requests, server_pair_key(sp), sp))
+		sp->flags |= DELIVERED;
+}
+
+void deliver_request(struct r2p2_server_pair *sp)
+{
+	int iovcnt;
+
+	iovcnt = prepare_to_app_iovec(&sp->request);
+	rfn((long)sp, to_app_iovec, iovcnt);
+}
+
+void request_started(struct r2p2_server_pair *sp)
+{
+	if (sp->flags & ADMITTED)
+		admission_started(sp->arrived_at);
+}
+
+void forward_request(struct r2p2_server_pair *sp)
+{
+	if (CFG.workers) {
+		workers_dispatch(sp);
+		return;
+	}
+	request_started(sp);
+	deliver_request(sp);
+}
+
+void r2p2_msg_add_payload(struct r2p2_msg *msg, generic_buffer gb)
+{
+	if (msg->tail_buffer) {
+		chain_buffers(msg->tail_buffer, gb);
+		msg->tail_buffer = gb;
+	} else {
+		assert(msg->head_buffer == NULL);
+		assert(msg->tail_buffer == NULL);
+		msg->head_buffer = gb;
+		msg->tail_buffer = gb;
+	}
+}
+
+// Position of a received packet in its message, the first one is 0
+static inline uint16_t pck_index(generic_buffer gb)
+{
+	struct r2p2_header *h = get_buffer_payload(gb);
+
+	return is_first(h) ? 0 : h->p_order;
+}
+
+/*
+ * Slot a received packet into its position in the message, packets may
+ * arrive in any order. Returns without consuming the buffer -1 for
+ * duplicates and out of range indices, -2 if the packet set cannot grow.
+ */
+static int r2p2_msg_insert_payload(struct r2p2_msg *msg,
+								   struct pck_set *arrived, uint16_t expected,
+								   generic_buffer gb)
+{
+	generic_buffer prev, cur;
+	uint16_t idx;
+	int ret;
+
+	idx = pck_index(gb);
+	if (idx >= MAX_MSG_PCK || (expected && idx >= expected))
+		return -1;
+	ret = pck_set_add(arrived, idx, expected);
+	if (ret)
+		return ret;
+
+	// In order arrival is the common case
+	if (!msg->tail_buffer || pck_index(msg->tail_buffer) < idx) {
+		r2p2_msg_add_payload(msg, gb);
+		return 0;
+	}
+
+	prev = NULL;
+	cur = msg->head_buffer;
+	while (pck_index(cur) < idx) {
+		prev = cur;
+		cur = get_buffer_next(cur);
+	}
+	chain_buffers(gb, cur);
+	if (prev)
+		chain_buffers(prev, gb);
+	else
+		msg->head_buffer = gb;
+
+	return 0;
+}
+
+/*
+ * Hand the packets that now extend the in order prefix of a request to the
+ * app and free them, only the ones after a hole stay buffered. Not the
+ * last chunk, the response still reads its header.
+ */
+static void stream_request(struct r2p2_server_pair *sp)
+{
+	struct r2p2_msg *msg = &sp->request;
+	generic_buffer first, gb, next;
+	int i, iovcnt = 0;
+
+	grow_app_iovec(sp->request_expected_packets);
+	gb = msg->head_buffer;
+	while (gb && pck_index(gb) == sp->request_delivered_packets) {
+		to_app_iovec[iovcnt].iov_base = pck_payload(gb);
+		to_app_iovec[iovcnt++].iov_len = pck_payload_size(gb);
+		sp->request_delivered_packets++;
+		gb = get_buffer_next(gb);
+	}
+	if (!iovcnt)
+		return;
+	if (sp->request_delivered_packets == iovcnt) {
+		hand_to_app(sp);
+		request_started(sp);
+	}
+
+	if (sp->request_delivered_packets == sp->request_expected_packets) {
+		sfn((long)sp, to_app_iovec, iovcnt, 1);
+		return;
+	}
+
+	first = msg->head_buffer;
+	msg->head_buffer = gb;
+	if (!gb)
+		msg->tail_buffer = NULL;
+	sfn((long)sp, to_app_iovec, iovcnt, 0);
+	for (i = 0; i < iovcnt; i++) {
+		next = get_buffer_next(first);
+		free_buffer(first);
+		first = next;
+	}
+}
+
+// Header extensions the first packet of each message type carries
+#define EXT_BIT(type) (1 << (type))
+
+static const uint8_t ext_value_size[] = {
+	[EXT_CREDIT] = sizeof(uint16_t),
+	[EXT_DEADLINE] = sizeof(uint32_t),
+	[EXT_EPOCH] = sizeof(uint32_t),
+	[EXT_LOAD] = sizeof(uint16_t),
+};
+
+static unsigned int ext_size(int exts)
+{
+	unsigned int type, size = 0;
+
+	for (type = 1; type < sizeof(ext_value_size); type++)
+		if (exts & EXT_BIT(type))
+			size += sizeof(struct r2p2_ext) + ext_value_size[type];
+	return size;
+}
+
+static void init_ext(struct r2p2_header *r2p2h, int exts)
+{
+	struct r2p2_ext *ext = (struct r2p2_ext *)(r2p2h + 1);
+	unsigned int type;
+
+	// The values are filled in right before sending
+	for (type = 1; type < sizeof(ext_value_size); type++) {
+		if (!(exts & EXT_BIT(type)))
+			continue;
+		ext->type = type;
+		ext->len = ext_value_size[type];
+		bzero(ext + 1, ext->len);
+		ext = (struct r2p2_ext *)((char *)(ext + 1) + ext->len);
+	}
+}
+
+static int alloc_msg(struct r2p2_msg *msg, uint32_t len, uint8_t req_type,
+					 uint8_t policy, uint16_t req_id,
+					 struct r2p2_host_tuple *dest, int exts)
+{
+	unsigned int buffer_cnt, should_small_first, to_fill, left, payload_size;
+	unsigned int ext_len, first_size, eager, hdr_len;
+	struct r2p2_header *r2p2h;
+	generic_buffer gb;
+
+	msg->req_id = req_id;
+	// Fix endianness for the header
+	req_id = htons(req_id);
+
+	payload_size = PAYLOAD_SIZE(dest_mtu(dest));
+	ext_len = ext_size(exts);
+
+	/*
+	 * Multi-packet requests start with a small packet, unless the server
+	 * gave us the credit to send them at once
+	 */
+	eager = 0;
+	should_small_first = (len > payload_size) && (req_type == REQUEST_MSG);
+	if (should_small_first && policy == FIXED_ROUTE)
+		eager = take_credit(dest, (len + payload_size - 1) / payload_size);
+	should_small_first &= !eager;
+	first_size = should_small_first ? MIN_PAYLOAD_SIZE : payload_size - ext_len;
+
+	// The packet count has to fit in p_order
+	left = len > first_size ? len - first_size : 0;
+	if ((left + payload_size - 1) / payload_size + 1 > MAX_MSG_PCK)
+		return -1;
+
+	left = len;
+	buffer_cnt = 0;
+	do {
+		if (buffer_cnt == 0)
+			to_fill = min(left, first_size);
+		else
+			to_fill = min(left, payload_size);
+		hdr_len = sizeof(struct r2p2_header) + (buffer_cnt ? 0 : ext_len);
+		// Valid, but larger than the buffers left
+		gb = stashed ? stash[--stashed] : get_buffer();
+		if (!gb) {
+			free_msg_buffers(msg);
+			return -1;
+		}
+		r2p2_msg_add_payload(msg, gb);
+		set_buffer_payload_size(gb, to_fill + hdr_len);
+
+		// FIX the header
+		r2p2h = (struct r2p2_header *)get_buffer_payload(gb);
+		bzero(r2p2h, sizeof(struct r2p2_header));
+		r2p2h->magic = MAGIC;
+		r2p2h->rid = req_id;
+		r2p2h->header_size = hdr_len;
+		r2p2h->type_policy = (req_type << 4) | (0x0F & policy);
+		r2p2h->p_order = htons(buffer_cnt++);
+		r2p2h->flags = 0;
+
+		left -= to_fill;
+	} while (left);
+
+	// Fix the header of the first and last packet
+	r2p2h = (struct r2p2_header *)get_buffer_payload(msg->head_buffer);
+	r2p2h->flags |= F_FLAG | (eager ? E_FLAG : 0) |
+					(req_type == REQUEST_MSG ? X_FLAG : 0);
+	r2p2h->p_order = htons(buffer_cnt);
+	init_ext(r2p2h, exts);
+	r2p2h = (struct r2p2_header *)get_buffer_payload(msg->tail_buffer);
+	r2p2h->flags |= L_FLAG;
+
+	return 0;
+}
+
+int r2p2_alloc_msg(struct r2p2_msg *msg, uint32_t len, uint8_t req_type,
+				   uint8_t policy, uint16_t req_id,
+				   struct r2p2_host_tuple *dest)
+{
+	return alloc_msg(msg, len, req_type, policy, req_id, dest, 0);
+}
+
+static int prepare_msg(struct r2p2_msg *msg, struct iovec *iov, int iovcnt,
+					   uint8_t req_type, uint8_t policy, uint16_t req_id,
+					   struct r2p2_host_tuple *dest, int exts)
+{
+	int i, bufferleft, copied, tocopy;
+	uint32_t total_payload;
+	generic_buffer gb;
+	char *target, *src;
+
+	total_payload = 0;
+	for (i = 0; i < iovcnt; i++)
+		total_payload += iov[i].iov_len;
+
+	if (alloc_msg(msg, total_payload, req_type, policy, req_id, dest, exts))
+		return -1;
+
+	gb = msg->head_buffer;
+	target = pck_payload(gb);
+	bufferleft = pck_payload_size(gb);
+	for (i = 0; i < iovcnt; i++) {
+		src = iov[i].iov_base;
+		copied = 0;
+		while (copied < (int)iov[i].iov_len) {
+			if (!bufferleft) {
+				gb = get_buffer_next(gb);
+				assert(gb);
+				target = pck_payload(gb);
+				bufferleft = pck_payload_size(gb);
+			}
+			tocopy = min(bufferleft, (int)(iov[i].iov_len - copied));
+			memcpy(target, &src[copied], tocopy);
+			copied += tocopy;
+			bufferleft -= tocopy;
+			target += tocopy;
+		}
+	}
+
+	return 0;
+}
+
+int r2p2_prepare_msg(struct r2p2_msg *msg, struct iovec *iov, int iovcnt,
+					 uint8_t req_type, uint8_t policy, uint16_t req_id,
+					 struct r2p2_host_tuple *dest)
+{
+	return prepare_msg(msg, iov, iovcnt, req_type, policy, req_id, dest, 0);
+}
+
+// The deadline budget is relative, our clock starts it on arrival
+static void read_deadline(struct r2p2_server_pair *sp,
+						  struct r2p2_header *r2p2h)
+{
+	uint32_t budget;
+	void *ext;
+
+	ext = find_ext(r2p2h, EXT_DEADLINE);
+	if (!ext)
+		return;
+	memcpy(&budget, ext, sizeof(uint32_t));
+	sp->deadline_at = time_us() + ntohl(budget);
+}
+
+// Epoch of a request to deduplicate, 0 if it has none or dedup is off
+static uint32_t read_epoch(struct r2p2_header *r2p2h)
+{
+	uint32_t epoch;
+	void *ext;
+
+	if (!CFG.dedup_entries || get_msg_type(r2p2h) != REQUEST_MSG ||
+		is_replicated_req(r2p2h))
+		return 0;
+	ext = find_ext(r2p2h, EXT_EPOCH);
+	if (!ext)
+		return 0;
+	memcpy(&epoch, ext, sizeof(uint32_t));
+	return ntohl(epoch);
+}
+
+// Nobody waits for the reply, don't spend a worker on it
+static int past_deadline(struct r2p2_server_pair *sp)
+{
+	return sp->deadline_at && !sp->request_delivered_packets &&
+		   time_us() > sp->deadline_at;
+}
+
+static int should_keep_req(struct r2p2_server_pair *sp,
+						   struct r2p2_header *r2p2h, int over_cap)
+{
+	if (over_cap || (afc_fn && !afc_fn())) {
+		admission_reject();
+		return 0;
+	}
+	// Replicated requests are answered from the worker thread
+	if (is_replicated_req(r2p2h))
+		return 1;
+	if (!admission_admit())
+		return 0;
+	sp->flags |= ADMITTED;
+	sp->arrived_at = polled_at;
+	return 1;
+}
+
+static void send_drop(uint16_t req_id, struct r2p2_host_tuple *dest)
+{
+	char drop_payload[] = "DROP";
+	struct iovec ack;
+	struct r2p2_msg drop_msg = {0};
+
+	ack.iov_base = drop_payload;
+	ack.iov_len = 4;
+	if (r2p2_prepare_msg(&drop_msg, &ack, 1, DROP_MSG, FIXED_ROUTE, req_id,
+						 dest))
+		return;
+	buf_list_send(drop_msg.head_buffer, dest, NULL);
+#ifdef LINUX
+	free_buffer(drop_msg.head_buffer);
+#endif
+}
+
+static void send_drop_msg(struct r2p2_server_pair *sp)
+{
+	send_drop(sp->request.req_id, &sp->request.sender);
+}
+
+// Retries of a request freed without a reply get a DROP, not another run
+static void dedup_close(struct r2p2_server_pair *sp)
+{
+	if (sp->epoch)
+		dedup_dropped(&sp->request.sender, sp->request.req_id, sp->epoch);
+}
+
+int drop_late_request(struct r2p2_server_pair *sp)
+{
+	if (!past_deadline(sp))
+		return 0;
+	dedup_close(sp);
+	send_drop_msg(sp);
+	free_server_pair(sp);
+	return 1;
+}
+
+// Nobody waits for the reply of a cancelled request
+int drop_cancelled_request(struct r2p2_server_pair *sp)
+{
+	if (!sp->cancelled)
+		return 0;
+	dedup_close(sp);
+	router_notify(sp->request.sender.ip, sp->request.sender.port,
+				  sp->request.req_id);
+	free_server_pair(sp);
+	return 1;
+}
+
+static void send_ack(uint16_t req_id, struct r2p2_host_tuple *dest)
+{
+	char ack_payload[] = "ACK";
+	struct iovec ack;
+	struct r2p2_msg ack_msg = {0};
+
+	ack.iov_base = ack_payload;
+	ack.iov_len = 3;
+	if (r2p2_prepare_msg(&ack_msg, &ack, 1, ACK_MSG, FIXED_ROUTE, req_id,
+						 dest))
+		return;
+	buf_list_send(ack_msg.head_buffer, dest, NULL);
+#ifdef LINUX
+	free_buffer(ack_msg.head_buffer);
+#endif
+}
+
+/*
+ * LB_ROUTE requests go through the router, unless the config has the
+ * client balance them among the servers itself
+ */
+static void route_req(struct r2p2_client_pair *cp)
+{
+	int target;
+
+	if (cp->ctx->routing_policy != LB_ROUTE || !client_lb_enabled()) {
+		cp->destination = cp->ctx->destination;
+		return;
+	}
+	target = client_lb_pick();
+	cp->lb_target = target + 1;
+	cp->destination = client_lb_target(target);
+}
+
+// Balanced in the client, the request goes straight to the server
+static inline uint8_t req_policy(struct r2p2_client_pair *cp)
+{
+	return cp->lb_target ? FIXED_ROUTE : cp->ctx->routing_policy;
+}
+
+static void timer_triggered(struct wheel_timer *t);
+static void hedge_triggered(struct wheel_timer *t);
+
+static void arm_req_timer(struct r2p2_client_pair *cp)
+{
+	long timeout = req_timeout(cp);
+
+	if (timeout)
+		arm_timer(&cp->timer, timeout, timer_triggered);
+}
+
+static void send_cancel(struct r2p2_client_pair *cp)
+{
+	char cancel_payload[] = "CANCEL";
+	struct r2p2_host_tuple *dest;
+	struct r2p2_msg cancel_msg = {0};
+	struct iovec cancel;
+	uint8_t policy;
+
+	// Once a server answered, it's the one with the request
+	if (cp->reply.sender.ip) {
+		dest = &cp->reply.sender;
+		policy = FIXED_ROUTE;
+	} else {
+		dest = cp->destination;
+		policy = req_policy(cp);
+	}
+	cancel.iov_base = cancel_payload;
+	cancel.iov_len = 6;
+	if (r2p2_prepare_msg(&cancel_msg, &cancel, 1, CANCEL_MSG, policy,
+						 cp->request.req_id, dest))
+		return;
+	buf_list_send(cancel_msg.head_buffer, dest, cp->impl_data);
+#ifdef LINUX
+	free_buffer(cancel_msg.head_buffer);
+#endif
+}
+
+/*
+ * Adaptive timeouts detect loss rather than enforce a deadline, they
+ * restart whenever the exchange makes progress
+ */
+static void note_progress(struct r2p2_client_pair *cp)
+{
+	if (cp->ctx->timeout != R2P2_ADAPTIVE_TIMEOUT)
+		return;
+	timer_wheel_cancel(&timers, &cp->timer);
+	arm_req_timer(cp);
+}
+
+/*
+ * The request buffers stay around for NACKs once sent. On DPDK the first
+ * packet is consumed by the send, unless kept for retries or hedging.
+ */
+static inline int keeps_first_pck(struct r2p2_client_pair *cp)
+{
+#ifdef LINUX
+	return 1;
+#else
+	return req_retry(cp) != NULL || req_hedge_delay(cp) > 0;
+#endif
+}
+
+static void send_rest_of_request(struct r2p2_client_pair *cp)
+{
+	generic_buffer rest_to_send;
+
+	if (keeps_first_pck(cp))
+		rest_to_send = get_buffer_next(cp->request.head_buffer);
+	else
+		rest_to_send = cp->request.head_buffer;
+	/*
+	 * Keep them around for NACKs. Eager requests don't know the replying
+	 * host yet, they are fixed route. Retries may have sent them before.
+	 */
+	send_kept_buffers(rest_to_send, cp->attempts > 0,
+					  cp->eager ? cp->destination : &cp->reply.sender,
+					  cp->impl_data);
+	cp->last_resend = time_us();
+	cp->state = R2P2_W_RESPONSE;
+	note_progress(cp);
+}
+
+/*
+ * Tell the server how much of the deadline is left for this attempt, in
+ * first, the first packet that goes out for it
+ */
+static void stamp_deadline(struct r2p2_client_pair *cp, generic_buffer first)
+{
+	uint32_t budget;
+	void *ext;
+	long left;
+
+	if (!cp->deadline_at)
+		return;
+	ext = find_ext(get_buffer_payload(first), EXT_DEADLINE);
+	assert(ext);
+	left = cp->deadline_at - cp->sent_at;
+	budget = htonl(left > 0 ? left : 1);
+	memcpy(ext, &budget, sizeof(uint32_t));
+}
+
+// Send the first packet, or all of them when eager
+static void send_first_pck(struct r2p2_client_pair *cp)
+{
+	generic_buffer second_buffer, gb;
+
+	cp->state = cp->request.head_buffer == cp->request.tail_buffer
+					? R2P2_W_RESPONSE
+					: R2P2_W_ACK;
+	second_buffer = get_buffer_next(cp->request.head_buffer);
+	chain_buffers(cp->request.head_buffer, NULL);
+	if (!keeps_first_pck(cp)) {
+		buf_list_send(cp->request.head_buffer, cp->destination,
+					  cp->impl_data);
+		cp->request.head_buffer = second_buffer;
+	} else if (cp->attempts) {
+		// A retry, the earlier send may still be queued, stamp what goes out
+		gb = resend_buffer(cp->request.head_buffer);
+		if (gb) {
+			stamp_deadline(cp, gb);
+			buf_list_send(gb, cp->destination, cp->impl_data);
+		}
+		chain_buffers(cp->request.head_buffer, second_buffer);
+	} else {
+		send_kept_buffers(cp->request.head_buffer, 0, cp->destination,
+						  cp->impl_data);
+		chain_buffers(cp->request.head_buffer, second_buffer);
+	}
+	if (cp->eager)
+		send_rest_of_request(cp);
+}
+
+/*
+ * Client retries
+ */
+// Backoff before retry n, jittered so that clients don't come back in sync
+static long retry_backoff(struct r2p2_retry_policy *rp, int n)
+{
+	long backoff = rp->base_backoff;
+
+	while (--n && backoff < rp->max_backoff)
+		backoff *= 2;
+	if (backoff > rp->max_backoff)
+		backoff = rp->max_backoff;
+	return backoff - (long)(backoff * rp->jitter * rand() / RAND_MAX);
+}
+
+// Back off and resend the request instead of failing it, if the policy allows
+static int retry_req(struct r2p2_client_pair *cp, int err)
+{
+	struct r2p2_retry_policy *rp = req_retry(cp);
+	long backoff;
+
+	if (!rp || cp->attempts + 1 >= rp->max_attempts ||
+		(err == -ERR_DROP_MSG && !rp->retry_drop))
+		return 0;
+	backoff = retry_backoff(rp, cp->attempts + 1);
+	// The server would drop a retry that can't make the deadline anyway
+	if (cp->deadline_at && time_us() + backoff >= cp->deadline_at)
+		return 0;
+
+	timer_wheel_cancel(&timers, &cp->timer);
+	timer_wheel_cancel(&timers, &cp->gap_timer);
+	arm_timer(&cp->timer, backoff, timer_triggered);
+	cp->attempts++;
+	cp->state = R2P2_W_RETRY;
+	return 1;
+}
+
+static void resend_req(struct r2p2_client_pair *cp)
+{
+	// Start over with the reply, the server answers the retry anew
+	free_msg_buffers(&cp->reply);
+	pck_set_free(&cp->reply_arrived);
+	bzero(&cp->reply_arrived, sizeof(struct pck_set));
+	cp->reply_expected_packets = 0;
+	cp->reply_received_packets = 0;
+	cp->nacks_sent = 0;
+
+	cp->sent_at = time_us();
+	arm_req_timer(cp);
+	send_first_pck(cp);
+}
+
+/*
+ * The first pair of a hedged request is its handle, it stays until the
+ * request ends. The reissued copy goes as soon as it is of no use.
+ */
+static inline int hedge_in_flight(struct r2p2_client_pair *cp)
+{
+	return cp->hedge && cp->hedge->state != R2P2_W_HEDGE;
+}
+
+// One copy is out, the other one still has a chance
+static void drop_hedge_copy(struct r2p2_client_pair *cp)
+{
+	remove_from_pending_client_pairs(cp);
+	if (cp->hedge_copy) {
+		free_client_pair(cp);
+		return;
+	}
+	timer_wheel_cancel(&timers, &cp->timer);
+	timer_wheel_cancel(&timers, &cp->gap_timer);
+	if (cp->lb_target)
+		client_lb_done(cp->lb_target - 1);
+	cp->lb_target = 0;
+	cp->state = R2P2_W_HEDGE;
+}
+
+static void settle_hedge(struct r2p2_client_pair *winner)
+{
+	struct r2p2_client_pair *loser = winner->hedge;
+
+	if (!hedge_in_flight(winner))
+		return;
+	if (winner->hedge_copy)
+		hedge_stats.hedge_wins++;
+	send_cancel(loser);
+	drop_hedge_copy(loser);
+}
+
+// The request ended with cp, free the first pair if cp is the copy
+static void end_hedge(struct r2p2_client_pair *cp)
+{
+	if (cp->hedge)
+		free_client_pair(cp->hedge);
+}
+
+static void handle_drop_msg(struct r2p2_client_pair *cp)
+{
+	if (retry_req(cp, -ERR_DROP_MSG))
+		return;
+	if (hedge_in_flight(cp)) {
+		drop_hedge_copy(cp);
+		return;
+	}
+
+	end_hedge(cp);
+	notify_error(cp->ctx, -ERR_DROP_MSG);
+
+	remove_from_pending_client_pairs(cp);
+	free_client_pair(cp);
+}
+
+// Out of memory for the reply's packet set, the rest cannot be taken
+static void fail_reassembly(struct r2p2_client_pair *cp)
+{
+	if (hedge_in_flight(cp)) {
+		drop_hedge_copy(cp);
+		return;
+	}
+
+	end_hedge(cp);
+	notify_error(cp->ctx, -ERR_MSG_SIZE);
+
+	remove_from_pending_client_pairs(cp);
+	free_client_pair(cp);
+}
+
+static void handle_response(generic_buffer gb, int len,
+							struct r2p2_header *r2p2h,
+							struct r2p2_host_tuple *source,
+#ifdef WITH_TIMESTAMPING
+							struct r2p2_host_tuple *local_host,
+							const struct timespec *last_rx_timestamp)
+#else
+							struct r2p2_host_tuple *local_host)
+#endif
+{
+	struct r2p2_client_pair *cp;
+	uint16_t *credit, *load;
+	int iovcnt, ret;
+
+	cp = find_in_pending_client_pairs(r2p2h->rid, local_host);
+	if (!cp) {
+		// printf("Expired timer?\n");
+		free_buffer(gb);
+		return;
+	}
+	/*
+	 * Answered, the pair is the app's until r2p2_recv_resp_done(). A late
+	 * DROP, ACK or NACK of an earlier attempt must not complete it again.
+	 */
+	if (reply_complete(cp)) {
+		free_buffer(gb);
+		return;
+	}
+
+#ifdef WITH_TIMESTAMPING
+	// Update ctx rx_timestamp if bigger than the current one.
+	if (last_rx_timestamp != NULL && last_rx_timestamp->tv_sec != 0 &&
+		is_smaller_than(&cp->ctx->rx_timestamp, last_rx_timestamp)) {
+		cp->ctx->rx_timestamp = *last_rx_timestamp;
 	}
 #endif
 
@@ -405,37 +1751,50 @@ static void handle_response(generic_buffer gb, int len,
 			assert(0);
 #endif
 		case RESPONSE_MSG:
-			assert(cp->state == R2P2_W_RESPONSE);
+			// In any state, it might answer an attempt before a retry
 			set_buffer_payload_size(gb, len);
-			r2p2_msg_add_payload(&cp->reply, gb);
-
+			ret = r2p2_msg_insert_payload(&cp->reply, &cp->reply_arrived,
+										  cp->reply_expected_packets, gb);
+			if (ret) {
+				free_buffer(gb);
+				if (ret == -2)
+					fail_reassembly(cp);
+				return;
+			}
+			if (!cp->reply_received_packets++) {
+				// Retried ones are ambiguous, which attempt got the reply?
+				if (!cp->attempts)
+					rtt_sample(cp->destination, (time_us() - cp->sent_at) /
+													cp->request_packets);
+				// The first copy of a hedged request to answer wins
+				if (cp->hedge)
+					settle_hedge(cp);
+			}
 			if (is_first(r2p2h)) {
 				cp->reply_expected_packets = r2p2h->p_order;
-				cp->reply_received_packets = 1;
-			} else {
-				if (r2p2h->p_order != cp->reply_received_packets++) {
-					printf("OOF in response\n");
-					cp->ctx->error_cb(cp->ctx->arg, -1);
-					remove_from_pending_client_pairs(cp);
-					free_client_pair(cp);
-					return;
-				}
+				credit = find_ext(r2p2h, EXT_CREDIT);
+				if (credit)
+					grant_credit(source, ntohs(*credit));
+				load = find_ext(r2p2h, EXT_LOAD);
+				if (load && cp->lb_target)
+					client_lb_report(cp->lb_target - 1, ntohs(*load));
 			}
 
 			// Is it full msg? Should I call the application?
-			if (!is_last(r2p2h))
-				return;
-
 			if (cp->reply_received_packets != cp->reply_expected_packets) {
-				printf("Wrong total size in response\n");
-				cp->ctx->error_cb(cp->ctx->arg, -1);
-				remove_from_pending_client_pairs(cp);
-				free_client_pair(cp);
+				note_progress(cp);
+				// Ask for the missing packets if the rest don't show up
+				if (get_msg_type(r2p2h) == RESPONSE_MSG) {
+					timer_wheel_cancel(&timers, &cp->gap_timer);
+					cp->nacks_sent = 0;
+					arm_timer(&cp->gap_timer, REASSEMBLY_GAP,
+							  reply_gap_expired);
+				}
 				return;
 			}
-			if (cp->timer)
-				disarm_timer(cp->timer);
-			iovcnt = prepare_to_app_iovec(&cp->reply);
+
+			timer_wheel_cancel(&timers, &cp->timer);
+			timer_wheel_cancel(&timers, &cp->gap_timer);
 
 #ifdef WITH_TIMESTAMPING
 			// Extract tx timestamp if it wasn't there (due to packet order)
@@ -446,26 +1805,40 @@ static void handle_response(generic_buffer gb, int len,
 			}
 #endif
 
+			if (cp->lb_target)
+				client_lb_done(cp->lb_target - 1);
+			end_hedge(cp);
+			if (uses_cq(cp->ctx)) {
+				cq_push(cp->ctx->arg, (long)cp, R2P2_CQ_SUCCESS, 0);
+				break;
+			}
+			iovcnt = prepare_to_app_iovec(&cp->reply);
 			cp->ctx->success_cb((long)cp, cp->ctx->arg, to_app_iovec, iovcnt);
 			break;
 		case ACK_MSG:
 			// Send the rest packets
-			assert(cp->state == R2P2_W_ACK);
 			if (len != (sizeof(struct r2p2_header) + 3))
 				printf("ACK msg size is %d\n", len);
 			assert(len == (sizeof(struct r2p2_header) + 3));
 			free_buffer(gb);
-#ifdef LINUX
-			rest_to_send = get_buffer_next(cp->request.head_buffer);
-#else
-			rest_to_send = cp->request.head_buffer;
-#endif
-			buf_list_send(rest_to_send, &cp->reply.sender, cp->impl_data);
-			cp->state = R2P2_W_RESPONSE;
+			// Late, for an earlier attempt
+			if (cp->state != R2P2_W_ACK)
+				break;
+			send_rest_of_request(cp);
+			break;
+		case NACK_MSG:
+			// A NACK before the ACK means that the ACK was lost
+			if (cp->state == R2P2_W_ACK)
+				send_rest_of_request(cp);
+			else if (cp->state == R2P2_W_RESPONSE)
+				resend_packets(&cp->request, &cp->last_resend, r2p2h, len,
+							   &cp->reply.sender, cp->impl_data);
+			free_buffer(gb);
 			break;
 		case DROP_MSG:
-			handle_drop_msg(cp);
 			free_buffer(gb);
+			if (cp->state != R2P2_W_RETRY)
+				handle_drop_msg(cp);
 			break;
 		default:
 			fprintf(stderr, "Unknown msg type %d for response\n",
@@ -474,34 +1847,125 @@ static void handle_response(generic_buffer gb, int len,
 	}
 }
 
+// The client gave up on the request, stop spending work on it
+static void cancel_request(uint16_t req_id, struct r2p2_host_tuple *source)
+{
+	struct r2p2_server_pair *sp;
+	uint64_t key;
+
+	sp = find_in_pending_server_pairs(req_id, source);
+	if (sp) {
+		drop_pending_server_pair(sp);
+		return;
+	}
+	key = pair_key(source->ip, source->port, req_id);
+	sp = CFG.cancel_delivered ? pair_table_lookup(delivered_requests, key)
+							  : NULL;
+	if (sp) {
+		// A worker may be running it, it polls r2p2_is_cancelled()
+		__atomic_store_n(&sp->cancelled, 1, __ATOMIC_RELAXED);
+		return;
+	}
+	sp = pair_table_lookup(lingering_replies, key);
+	if (sp)
+		free_lingering_reply(sp);
+}
+
+/*
+ * Don't let a single sender or a lossy network exhaust the pairs pool with
+ * reassemblies that will never complete, nor large requests the buffers
+ */
+static int over_reassembly_cap(struct r2p2_header *r2p2h,
+							   struct r2p2_host_tuple *source)
+{
+	if (is_last(r2p2h))
+		return 0;
+	return *sender_pending_count(source) >= MAX_PENDING_PER_SENDER ||
+		   reassembly_pcks + r2p2h->p_order > REASSEMBLY_MAX_PCK;
+}
+
 static void handle_request(generic_buffer gb, int len,
 						   struct r2p2_header *r2p2h,
 						   struct r2p2_host_tuple *source)
 {
 	struct r2p2_server_pair *sp;
 	uint16_t req_id;
-	char ack_payload[] = "ACK";
-	struct iovec ack;
-	struct r2p2_msg ack_msg = {0};
-	int was_in_pending_sp = 0;
+	uint32_t epoch;
+	int was_in_pending_sp = 0, over_cap, streamed, ret;
 
 	req_id = r2p2h->rid;
+	if (get_msg_type(r2p2h) == NACK_MSG) {
+		sp = pair_table_lookup(lingering_replies,
+							   pair_key(source->ip, source->port, req_id));
+		if (sp) {
+			resend_packets(&sp->reply, &sp->last_resend, r2p2h, len, source,
+						   NULL);
+			// The client is still missing packets, keep the reply around
+			timer_wheel_cancel(&timers, &sp->gap_timer);
+			arm_timer(&sp->gap_timer, REPLY_LINGER, reply_linger_expired);
+		}
+		free_buffer(gb);
+		return;
+	}
+
+	if (get_msg_type(r2p2h) == CANCEL_MSG) {
+		cancel_request(req_id, source);
+		free_buffer(gb);
+		return;
+	}
+
 	if (is_first(r2p2h)) {
-		/*
-		 * FIXME
-		 * Consider the case that an old request with the same id and
-		 * src ip port is already there
-		 * remove before starting the new one
-		 */
+		// Only a single packet request is both first and last
+		if (!r2p2h->p_order || !is_last(r2p2h) != (r2p2h->p_order > 1)) {
+			free_buffer(gb);
+			return;
+		}
+
+		// The app already got this request, it's a retry
+		epoch = read_epoch(r2p2h);
+		switch (epoch ? dedup_check(source, req_id, epoch) : DEDUP_NEW) {
+		case DEDUP_UNCACHED:
+			// Its reply is gone, the client fails fast rather than retry
+			send_drop(req_id, source);
+			/* fall through */
+		case DEDUP_HANDLED:
+			free_buffer(gb);
+			return;
+		}
+
+		// An old request with the same id and source is stale, drop it
+		sp = find_in_pending_server_pairs(req_id, source);
+		if (sp)
+			drop_pending_server_pair(sp);
+		sp = pair_table_lookup(lingering_replies,
+							   pair_key(source->ip, source->port, req_id));
+		if (sp)
+			free_lingering_reply(sp);
+
+		over_cap = over_reassembly_cap(r2p2h, source);
+		if (over_cap || server_pairs->count == server_pairs->size) {
+			expire_pending_server_pairs(time_us());
+			over_cap = over_reassembly_cap(r2p2h, source);
+		}
+		if (server_pairs->count == server_pairs->size) {
+			free_buffer(gb);
+			return;
+		}
+
 		sp = alloc_server_pair();
 		assert(sp);
 		sp->request.sender = *source;
 		sp->request.req_id = req_id;
 		sp->request_expected_packets = r2p2h->p_order;
-		sp->request_received_packets = 1;
+		sp->epoch = epoch;
+		if (takes_exts(r2p2h))
+			sp->flags |= REPLY_EXTS;
+		if (get_msg_type(r2p2h) == REQUEST_MSG)
+			read_deadline(sp, r2p2h);
 
 		/* Flow control only request messages, not Raft reqs */
-		if (get_msg_type(r2p2h) == REQUEST_MSG && !should_keep_req(sp)) {
+		if (get_msg_type(r2p2h) == REQUEST_MSG &&
+			!should_keep_req(sp, r2p2h, over_cap)) {
 			set_buffer_payload_size(gb, len);
 			r2p2_msg_add_payload(&sp->request, gb);
 			send_drop_msg(sp);
@@ -515,14 +1979,10 @@ static void handle_request(generic_buffer gb, int len,
 
 			/* Raft reqs don't send REQ0 */
 			if (!is_raft_msg(r2p2h)) {
-				// send ACK
-				ack.iov_base = ack_payload;
-				ack.iov_len = 3;
-				r2p2_prepare_msg(&ack_msg, &ack, 1, ACK_MSG, FIXED_ROUTE, req_id);
-				buf_list_send(ack_msg.head_buffer, source, NULL);
-#ifdef LINUX
-				free_buffer(ack_msg.head_buffer);
-#endif
+				// Eager requests send the rest without waiting for it
+				if (!is_eager(r2p2h))
+					send_ack(req_id, source);
+				arm_timer(&sp->gap_timer, REASSEMBLY_GAP, request_gap_expired);
 			}
 		}
 	} else {
@@ -532,30 +1992,37 @@ static void handle_request(generic_buffer gb, int len,
 			free_buffer(gb);
 			return;
 		}
-		if (r2p2h->p_order != sp->request_received_packets++) {
-			printf("OOF in request\n");
-			remove_from_pending_server_pairs(sp);
-			free_buffer(gb);
-			free_server_pair(sp);
-			return;
-		}
+		touch_pending_server_pair(sp);
 		was_in_pending_sp = 1;
 	}
 	set_buffer_payload_size(gb, len);
-	r2p2_msg_add_payload(&sp->request, gb);
-
-	if (!is_last(r2p2h))
+	ret = r2p2_msg_insert_payload(&sp->request, &sp->request_arrived,
+								  sp->request_expected_packets, gb);
+	if (ret) {
+		free_buffer(gb);
+		// Only packets past the first grow the set, the pair is pending
+		if (ret == -2) {
+			send_drop_msg(sp);
+			drop_pending_server_pair(sp);
+		}
 		return;
+	}
 
-	if (sp->request_received_packets != sp->request_expected_packets) {
-		printf("Wrong total size in request\n");
-		remove_from_pending_server_pairs(sp);
-		free_server_pair(sp);
+	streamed = sfn && get_msg_type(r2p2h) == REQUEST_MSG &&
+			   !is_replicated_req(r2p2h);
+	if (++sp->request_received_packets != sp->request_expected_packets) {
+		if (streamed && past_deadline(sp)) {
+			send_drop_msg(sp);
+			drop_pending_server_pair(sp);
+		} else if (streamed)
+			stream_request(sp);
 		return;
 	}
 
 	if (was_in_pending_sp)
 		remove_from_pending_server_pairs(sp);
+	// Raft frees complete pairs on its own
+	pck_set_free(&sp->request_arrived);
 
 #ifdef ACCELERATED
 	sp->received_at = time_us();
@@ -575,8 +2042,14 @@ static void handle_request(generic_buffer gb, int len,
 #else
 		assert(0);
 #endif
+	else if (past_deadline(sp)) {
+		send_drop_msg(sp);
+		free_server_pair(sp);
+	} else if (streamed)
+		stream_request(sp);
 	else {
 		assert(rfn);
+		hand_to_app(sp);
 		forward_request(sp);
 	}
 }
@@ -605,6 +2078,11 @@ void handle_incoming_pck(generic_buffer gb, int len,
 	assert((unsigned)len >= sizeof(struct r2p2_header));
 	buf = get_buffer_payload(gb);
 	r2p2h = (struct r2p2_header *)buf;
+	if (r2p2h->header_size < sizeof(struct r2p2_header) ||
+		r2p2h->header_size > len) {
+		free_buffer(gb);
+		return;
+	}
 
 	// Fix endianness
 	r2p2h->rid = ntohs(r2p2h->rid);
@@ -630,42 +2108,117 @@ int r2p2_backend_init_per_core(void)
 {
 	time_t t;
 
-	client_pairs = create_mempool(POOL_SIZE, sizeof(struct r2p2_client_pair));
+	// The app gets the packets as they arrive, on the polling core
+	if (sfn && CFG.workers) {
+		fprintf(stderr, "Streaming receive does not run on workers\n");
+		return -1;
+	}
+
+	client_pairs = create_mempool(RID_SPACE, sizeof(struct r2p2_client_pair));
 	assert(client_pairs);
 	server_pairs = create_mempool(POOL_SIZE, sizeof(struct r2p2_server_pair));
 	assert(server_pairs);
+	multicalls = create_mempool(MULTICALL_POOL_SIZE,
+								sizeof(struct r2p2_multicall));
+	assert(multicalls);
+	pending_client_pairs = create_pair_table(CLIENT_PAIR_TABLE_SIZE);
+	pending_server_index = create_pair_table(PAIR_TABLE_SIZE);
+	lingering_replies = create_pair_table(PAIR_TABLE_SIZE);
+	delivered_requests = create_pair_table(PAIR_TABLE_SIZE);
+	dedup_init();
+	submit_init();
+	cq = malloc(CQ_SIZE * sizeof(struct r2p2_cq_entry));
+	assert(cq);
+	cq_size = CQ_SIZE;
+	to_app_iovec = malloc(INLINE_MSG_PCK * sizeof(struct iovec));
+	assert(to_app_iovec);
+	to_app_iovec_size = INLINE_MSG_PCK;
+	polled_at = time_us();
+	timer_wheel_init(&timers, polled_at / TIMER_TICK_US);
 
 	srand((unsigned)time(&t));
+	// Don't reuse the epochs of a previous run on the same port
+	next_epoch = time_us();
 
 #ifdef PACKET_LOSS
 	set_next_to_lose();
 #endif
-	return 0;
+	return workers_init();
 }
 
-void timer_triggered(struct r2p2_client_pair *cp)
-{
-	struct fixed_obj *fo = get_object_meta(cp);
-	if (!fo->taken)
+static void timer_triggered(struct wheel_timer *t)
+{
+	struct r2p2_client_pair *cp;
+
+	cp = container_of(t, struct r2p2_client_pair, timer);
+	// The backoff before a retry is over
+	if (cp->state == R2P2_W_RETRY) {
+		resend_req(cp);
+		return;
+	}
+	if (retry_req(cp, 0))
 		return;
 
-	assert(cp->ctx->timeout_cb);
-	cp->ctx->timeout_cb(cp->ctx->arg);
+	// Let the server know it can stop working on it
+	send_cancel(cp);
+	if (hedge_in_flight(cp)) {
+		drop_hedge_copy(cp);
+		return;
+	}
+	end_hedge(cp);
+	notify_timeout(cp->ctx);
 
 	remove_from_pending_client_pairs(cp);
 	free_client_pair(cp);
 }
 
+/*
+ * Called by the backends on every poll. The wheel has to follow the clock
+ * even when empty, or arming after an idle period would first have to
+ * catch up tick by tick.
+ */
+void r2p2_run_timers(void)
+{
+	long now;
+
+	now = time_us();
+	polled_at = now;
+	timer_wheel_advance(&timers, now / TIMER_TICK_US);
+	expire_pending_server_pairs(now);
+}
+
 /*
  * API
  */
-static inline void __r2p2_send_response(long handle, struct iovec *iov,
-		int iovcnt, int rep_type)
+static void send_prepared_response(struct r2p2_server_pair *sp)
 {
-	struct r2p2_server_pair *sp;
 	struct r2p2_header *r2p2h;
+	uint16_t *credit, *load;
+	int raft, lingering;
+
+	r2p2h = get_buffer_payload(sp->reply.head_buffer);
+	credit = find_ext(r2p2h, EXT_CREDIT);
+	if (credit)
+		*credit = htons(receive_credit());
+	if (sp->flags & ADMITTED) {
+		admission_done();
+		sp->flags &= ~ADMITTED;
+	}
+	// A hint for clients that balance the load themselves
+	load = find_ext(r2p2h, EXT_LOAD);
+	if (load)
+		*load = htons((min(admission_inflight(), UINT16_MAX)));
+	if (sp->flags & DELIVERED)
+		forget_delivered(sp);
+
+	if (sp->cancelled) {
+#ifndef LINUX
+		free_msg_buffers(&sp->reply);
+#endif
+		drop_cancelled_request(sp);
+		return;
+	}
 
-	sp = (struct r2p2_server_pair *)handle;
 	r2p2h = (struct r2p2_header *)get_buffer_payload(sp->request.head_buffer);
 	if (is_replicated_req(r2p2h)) {
 #ifndef WITH_RAFT
@@ -673,35 +2226,111 @@ static inline void __r2p2_send_response(long handle, struct iovec *iov,
 #endif
 		/* This runs in the worker thread */
 		/* Decide here who will reply */
-		if (!(sp->flags & SHOULD_REPLY))
+		if (!(sp->flags & SHOULD_REPLY)) {
+			free_msg_buffers(&sp->reply);
 			return;
-		bzero(&sp->reply, sizeof(struct r2p2_msg));
-		r2p2_prepare_msg(&sp->reply, iov, iovcnt, rep_type, FIXED_ROUTE,
-						 sp->request.req_id);
+		}
 		buf_list_send(sp->reply.head_buffer, &sp->request.sender, NULL);
 
 		// Notify router
 		router_notify(sp->request.sender.ip, sp->request.sender.port,
 				sp->request.req_id);
 	} else {
-		r2p2_prepare_msg(&sp->reply, iov, iovcnt, rep_type, FIXED_ROUTE,
-						 sp->request.req_id);
+		// Lingering frees the request, r2p2h points in it
+		raft = is_raft_msg(r2p2h);
+
+		if (sp->epoch)
+			dedup_done(&sp->request.sender, sp->request.req_id, sp->epoch,
+					   &sp->reply);
+
+		// Keep multi-packet replies to serve NACKs
+		lingering = !raft && sp->reply.head_buffer != sp->reply.tail_buffer &&
+					!linger_reply(sp);
 		buf_list_send(sp->reply.head_buffer, &sp->request.sender, NULL);
 
 		// Notify router not for Raft requests
-		if (!is_raft_msg(r2p2h))
+		if (!raft)
 			router_notify(sp->request.sender.ip, sp->request.sender.port,
 					sp->request.req_id);
 
+		if (!lingering)
+			free_server_pair(sp);
+	}
+}
+
+/*
+ * The credit and load hints ride in header extensions, which clients
+ * predating them would read as payload
+ */
+static int reply_exts(struct r2p2_server_pair *sp)
+{
+	if (!(sp->flags & REPLY_EXTS))
+		return 0;
+	return EXT_BIT(EXT_CREDIT) | EXT_BIT(EXT_LOAD);
+}
+
+static inline void __r2p2_send_response(long handle, struct iovec *iov,
+		int iovcnt, int rep_type)
+{
+	struct r2p2_server_pair *sp;
+	struct r2p2_header *r2p2h;
+
+	sp = (struct r2p2_server_pair *)handle;
+	r2p2h = (struct r2p2_header *)get_buffer_payload(sp->request.head_buffer);
+	if (is_replicated_req(r2p2h)) {
+		if (!(sp->flags & SHOULD_REPLY))
+			return;
+		bzero(&sp->reply, sizeof(struct r2p2_msg));
+	}
+	if (prepare_msg(&sp->reply, iov, iovcnt, rep_type, FIXED_ROUTE,
+					sp->request.req_id, &sp->request.sender,
+					rep_type == RESPONSE_MSG ? reply_exts(sp) : 0)) {
+		// Too large to send, fail the request instead of timing it out
+		dedup_close(sp);
+		send_drop_msg(sp);
 		free_server_pair(sp);
+		return;
 	}
+	send_prepared_response(sp);
 }
 
 void r2p2_send_response(long handle, struct iovec *iov, int iovcnt)
 {
+	if (in_worker()) {
+		worker_send_response(handle, iov, iovcnt);
+		return;
+	}
 	return __r2p2_send_response(handle, iov, iovcnt, RESPONSE_MSG);
 }
 
+int r2p2_reserve_response(long handle, int len, struct iovec *iov, int iovcnt)
+{
+	struct r2p2_server_pair *sp;
+	struct r2p2_header *r2p2h;
+
+	// Workers only reply with r2p2_send_response()
+	assert(!in_worker());
+	sp = (struct r2p2_server_pair *)handle;
+	r2p2h = (struct r2p2_header *)get_buffer_payload(sp->request.head_buffer);
+	if (is_replicated_req(r2p2h))
+		bzero(&sp->reply, sizeof(struct r2p2_msg));
+	assert(sp->reply.head_buffer == NULL);
+
+	if (alloc_msg(&sp->reply, len, RESPONSE_MSG, FIXED_ROUTE,
+				  sp->request.req_id, &sp->request.sender, reply_exts(sp)))
+		return -ERR_MSG_SIZE;
+	iovcnt = r2p2_msg_iovec(&sp->reply, iov, iovcnt);
+	if (iovcnt < 0)
+		free_msg_buffers(&sp->reply);
+
+	return iovcnt;
+}
+
+void r2p2_commit_response(long handle)
+{
+	send_prepared_response((struct r2p2_server_pair *)handle);
+}
+
 #ifdef WITH_RAFT
 void r2p2_send_raft_response(long handle, struct iovec *iov, int iovcnt)
 {
@@ -712,63 +2341,488 @@ void r2p2_send_raft_msg(struct r2p2_host_tuple *dst, struct iovec *iov, int iovc
 {
 	struct r2p2_msg reply = {0};
 
-	r2p2_prepare_msg(&reply, iov, iovcnt, RAFT_MSG, FIXED_ROUTE, 0);
+	if (r2p2_prepare_msg(&reply, iov, iovcnt, RAFT_MSG, FIXED_ROUTE, 0, dst))
+		return;
 	buf_list_send(reply.head_buffer, dst, NULL);
 }
 #endif
 
-static inline void __r2p2_send_req(struct iovec *iov, int iovcnt,
-		struct r2p2_ctx *ctx, int req_type)
+// Header extensions of the requests sent with ctx
+static int req_exts(struct r2p2_ctx *ctx)
 {
-	generic_buffer second_buffer;
-	struct r2p2_client_pair *cp;
+	int exts = 0;
+
+	if (ctx->deadline > 0)
+		exts |= EXT_BIT(EXT_DEADLINE);
+	// Let the server tell retries apart, with dedup on
+	if (ctx->retry)
+		exts |= EXT_BIT(EXT_EPOCH);
+	return exts;
+}
 
-	cp = alloc_client_pair();
-	assert(cp);
-	cp->ctx = ctx;
+/*
+ * Arm the timer and make the pair visible to incoming responses
+ */
+static int arm_req(struct r2p2_client_pair *cp, int req_type)
+{
+	struct r2p2_header *r2p2h;
+	uint32_t epoch;
+	void *ext;
 
+	// Its completions would be split between the callbacks and the CQ
+	if (mixes_cq(cp->ctx)) {
+		notify_error(cp->ctx, -ERR_MIXED_CQ);
+		free_client_pair(cp);
+		return -1;
+	}
 	if (prepare_to_send(cp)) {
 		free_client_pair(cp);
-		return;
+		return -1;
 	}
 
-	// FIXME: Make sure the rid is available
-	//rid = rand();
-	rid++;
-	r2p2_prepare_msg(&cp->request, iov, iovcnt, req_type, ctx->routing_policy,
-			rid);
-
 	add_to_pending_client_pairs(cp);
+	r2p2h = get_buffer_payload(cp->request.head_buffer);
+	cp->request_packets = ntohs(r2p2h->p_order);
+	cp->eager = is_eager(r2p2h);
+	cp->sent_at = time_us();
+	arm_req_timer(cp);
+	if (req_type == REQUEST_MSG && req_deadline(cp) > 0) {
+		// The copy of a hedged request has what's left of the deadline
+		cp->deadline_at = cp->hedge ? cp->hedge->deadline_at
+									: cp->sent_at + req_deadline(cp);
+		stamp_deadline(cp, cp->request.head_buffer);
+	}
+	if (!cp->hedge_copy) {
+		// Only single-packet requests, a copy would double a bulk transfer
+		if (req_type == REQUEST_MSG && req_hedge_delay(cp) > 0 &&
+			cp->request.head_buffer == cp->request.tail_buffer) {
+			arm_timer(&cp->hedge_timer, req_hedge_delay(cp),
+					  hedge_triggered);
+			hedge_stats.requests++;
+		}
+	}
+	// Set once, retries go out with the same epoch
+	ext = find_ext(r2p2h, EXT_EPOCH);
+	if (ext) {
+		if (!++next_epoch)
+			next_epoch++;
+		epoch = htonl(next_epoch);
+		memcpy(ext, &epoch, sizeof(uint32_t));
+	}
 
-	if (req_type == RAFT_REQ) {
+	if (req_type == RAFT_REQ)
 		cp->state = R2P2_W_RESPONSE;
-		buf_list_send(cp->request.head_buffer, ctx->destination, cp->impl_data);
-	} else {
+	else
 		cp->state = cp->request.head_buffer == cp->request.tail_buffer
 						? R2P2_W_RESPONSE
 						: R2P2_W_ACK;
+	return 0;
+}
 
-		// Send only the first packet
-		second_buffer = get_buffer_next(cp->request.head_buffer);
-		chain_buffers(cp->request.head_buffer, NULL);
-		buf_list_send(cp->request.head_buffer, ctx->destination, cp->impl_data);
-#ifdef LINUX
-		chain_buffers(cp->request.head_buffer, second_buffer);
-#else
-		cp->request.head_buffer = second_buffer;
+static int send_prepared_req(struct r2p2_client_pair *cp, int req_type)
+{
+	if (arm_req(cp, req_type))
+		return -1;
+
+	if (req_type == RAFT_REQ) {
+		buf_list_send(cp->request.head_buffer, cp->destination, cp->impl_data);
+#ifndef LINUX
+		// Consumed by the send
+		cp->request.head_buffer = NULL;
 #endif
+	} else
+		send_first_pck(cp);
+	return 0;
+}
+
+/*
+ * Hedged requests: without a reply within the hedge delay, the request
+ * goes out again under a new rid, to the hedge destination if any. The
+ * first copy to answer wins and the other one is cancelled.
+ */
+static void hedge_triggered(struct wheel_timer *t)
+{
+	struct r2p2_client_pair *cp, *copy;
+	struct r2p2_ctx *ctx;
+	int iovcnt;
+
+	cp = container_of(t, struct r2p2_client_pair, hedge_timer);
+	ctx = cp->ctx;
+	if (cp->reply_received_packets)
+		return;
+
+	copy = alloc_client_pair();
+	if (!copy)
+		return;
+	copy->ctx = ctx;
+	if (ctx->hedge_destination)
+		copy->destination = ctx->hedge_destination;
+	else
+		route_req(copy);
+	iovcnt = prepare_to_app_iovec(&cp->request);
+	if (prepare_msg(&copy->request, to_app_iovec, iovcnt, REQUEST_MSG,
+					req_policy(copy), copy->request.req_id,
+					copy->destination, req_exts(ctx))) {
+		free_client_pair(copy);
+		return;
+	}
+	copy->hedge = cp;
+	copy->hedge_copy = 1;
+	cp->hedge = copy;
+	if (!send_prepared_req(copy, REQUEST_MSG))
+		hedge_stats.hedged++;
+}
+
+static inline long __r2p2_send_req(struct iovec *iov, int iovcnt,
+		struct r2p2_ctx *ctx, int req_type, int classic)
+{
+	struct r2p2_client_pair *cp;
+
+	cp = alloc_client_pair();
+	if (!cp) {
+		notify_error(ctx, -ERR_NO_RID);
+		return 0;
+	}
+	cp->ctx = ctx;
+	cp->classic = classic;
+	route_req(cp);
+
+	if (prepare_msg(&cp->request, iov, iovcnt, req_type,
+					req_policy(cp), cp->request.req_id, cp->destination,
+					req_type == REQUEST_MSG && !classic ? req_exts(ctx) : 0)) {
+		free_client_pair(cp);
+		notify_error(ctx, -ERR_MSG_SIZE);
+		return 0;
 	}
+	if (send_prepared_req(cp, req_type))
+		return 0;
+	return (long)cp;
+}
+
+void r2p2_ctx_init(struct r2p2_ctx *ctx)
+{
+	bzero(ctx, sizeof(struct r2p2_ctx));
 }
 
 void r2p2_send_req(struct iovec *iov, int iovcnt, struct r2p2_ctx *ctx)
 {
-	__r2p2_send_req(iov, iovcnt, ctx, REQUEST_MSG);
+	__r2p2_send_req(iov, iovcnt, ctx, REQUEST_MSG, 1);
+}
+
+long r2p2_send_req_ex(struct iovec *iov, int iovcnt, struct r2p2_ctx *ctx)
+{
+	return __r2p2_send_req(iov, iovcnt, ctx, REQUEST_MSG, 0);
+}
+
+int r2p2_reserve_req(long *handle, int len, struct r2p2_ctx *ctx,
+					 struct iovec *iov, int iovcnt)
+{
+	struct r2p2_client_pair *cp;
+
+	if (mixes_cq(ctx))
+		return -ERR_MIXED_CQ;
+	cp = alloc_client_pair();
+	if (!cp)
+		return -ERR_NO_RID;
+	cp->ctx = ctx;
+	route_req(cp);
+
+	if (alloc_msg(&cp->request, len, REQUEST_MSG, req_policy(cp),
+				  cp->request.req_id, cp->destination, req_exts(ctx))) {
+		free_client_pair(cp);
+		return -ERR_MSG_SIZE;
+	}
+	iovcnt = r2p2_msg_iovec(&cp->request, iov, iovcnt);
+	if (iovcnt < 0) {
+		free_msg_buffers(&cp->request);
+		free_client_pair(cp);
+		return -1;
+	}
+
+	*handle = (long)cp;
+	return iovcnt;
+}
+
+void r2p2_commit_req(long handle)
+{
+	send_prepared_req((struct r2p2_client_pair *)handle, REQUEST_MSG);
+}
+
+static int __r2p2_send_req_batch(struct r2p2_req_desc *reqs, int n)
+{
+	struct r2p2_client_pair *cps[SEND_BATCH_SIZE];
+	generic_buffer bufs[SEND_BATCH_SIZE];
+	generic_buffer first_bufs[SEND_BATCH_SIZE];
+	generic_buffer second_bufs[SEND_BATCH_SIZE];
+	struct r2p2_host_tuple *dests[SEND_BATCH_SIZE];
+	void *socket_infos[SEND_BATCH_SIZE];
+	int req_idx[SEND_BATCH_SIZE];
+	int i, count, to_send;
+
+	// Short of n, the buffers are taken one by one as usual
+	if (!stashed && !get_buffers(bufs, n)) {
+		stash = bufs;
+		stashed = n;
+	}
+	count = 0;
+	for (i = 0; i < n; i++) {
+		reqs[i].handle = 0;
+		cps[count] = alloc_client_pair();
+		if (!cps[count]) {
+			notify_error(reqs[i].ctx, -ERR_NO_RID);
+			continue;
+		}
+		cps[count]->ctx = reqs[i].ctx;
+		route_req(cps[count]);
+		if (prepare_msg(&cps[count]->request, reqs[i].iov, reqs[i].iovcnt,
+						REQUEST_MSG, req_policy(cps[count]),
+						cps[count]->request.req_id, cps[count]->destination,
+						req_exts(reqs[i].ctx))) {
+			free_client_pair(cps[count]);
+			notify_error(reqs[i].ctx, -ERR_MSG_SIZE);
+			continue;
+		}
+		req_idx[count++] = i;
+	}
+	// Left by the requests that failed before preparing
+	while (stashed)
+		free_buffer(stash[--stashed]);
+
+	// Only the first packet of each request goes out now
+	to_send = 0;
+	for (i = 0; i < count; i++) {
+		if (arm_req(cps[i], REQUEST_MSG))
+			continue;
+		reqs[req_idx[i]].handle = (long)cps[i];
+		if (keeps_first_pck(cps[i]))
+			retain_buffer(cps[i]->request.head_buffer);
+		first_bufs[to_send] = cps[i]->request.head_buffer;
+		// Read before sending, the mbuf may be gone after
+		second_bufs[to_send] = get_buffer_next(first_bufs[to_send]);
+		dests[to_send] = cps[i]->destination;
+		socket_infos[to_send] = cps[i]->impl_data;
+		cps[to_send++] = cps[i];
+	}
+
+	buf_burst_send(first_bufs, dests, socket_infos, to_send);
+
+	for (i = 0; i < to_send; i++) {
+		if (keeps_first_pck(cps[i]))
+			chain_buffers(first_bufs[i], second_bufs[i]);
+		else
+			cps[i]->request.head_buffer = second_bufs[i];
+		if (cps[i]->eager)
+			send_rest_of_request(cps[i]);
+	}
+	return to_send;
+}
+
+int r2p2_send_req_batch(struct r2p2_req_desc *reqs, int n)
+{
+	int i, sent = 0;
+
+	for (i = 0; i < n; i += SEND_BATCH_SIZE)
+		sent += __r2p2_send_req_batch(&reqs[i], min(n - i, SEND_BATCH_SIZE));
+
+	return sent;
+}
+
+/*
+ * Multicalls. The request is prepared once for the first destination and
+ * copied packet by packet for the others, unless their path MTU is smaller
+ * or the credit of the first one made it eager.
+ */
+static int clone_msg(struct r2p2_msg *msg, struct r2p2_msg *from,
+					 uint16_t req_id)
+{
+	struct r2p2_header *r2p2h;
+	generic_buffer gb, copy;
+
+	msg->req_id = req_id;
+	for (gb = from->head_buffer; gb; gb = get_buffer_next(gb)) {
+		copy = copy_buffer(gb);
+		if (!copy) {
+			free_msg_buffers(msg);
+			return -1;
+		}
+		r2p2_msg_add_payload(msg, copy);
+		r2p2h = get_buffer_payload(copy);
+		r2p2h->rid = htons(req_id);
+	}
+	return 0;
+}
+
+static void free_multicall(struct r2p2_multicall *mc)
+{
+	timer_wheel_cancel(&timers, &mc->stagger_timer);
+	free_msg_buffers(&mc->request);
+	free_object(mc);
+}
+
+static void end_multicall(struct r2p2_multicall *mc)
+{
+	int i;
+
+	mc->ended = 1;
+	for (i = 0; i < mc->sent; i++) {
+		if (mc->members[i].handle)
+			r2p2_cancel_req(mc->members[i].handle);
+		mc->members[i].handle = 0;
+	}
+	if (!mc->sending)
+		free_multicall(mc);
+}
+
+static void member_success(long handle, void *arg, struct iovec *iov,
+						   int iovcnt)
+{
+	struct r2p2_multicall_member *m = arg;
+	struct r2p2_multicall *mc = m->mc;
+
+	m->handle = 0;
+	if (uses_cq(mc->ctx))
+		cq_push(mc->ctx->arg, handle, R2P2_CQ_SUCCESS, 0);
+	else
+		mc->ctx->success_cb(handle, mc->ctx->arg, iov, iovcnt);
+	if (++mc->answered == mc->k)
+		end_multicall(mc);
+}
+
+static void member_failed(struct r2p2_multicall_member *m, int err)
+{
+	struct r2p2_multicall *mc = m->mc;
+	struct r2p2_ctx *ctx = mc->ctx;
+
+	m->handle = 0;
+	if (mc->ended || mc->n - ++mc->failed >= mc->k)
+		return;
+	// The callback may reuse the ctx
+	end_multicall(mc);
+	if (err)
+		notify_error(ctx, err);
+	else
+		notify_timeout(ctx);
+}
+
+static void member_error(void *arg, int err)
+{
+	member_failed(arg, err);
+}
+
+static void member_timeout(void *arg)
+{
+	member_failed(arg, 0);
+}
+
+static void send_member(struct r2p2_multicall *mc)
+{
+	struct r2p2_multicall_member *m;
+	struct r2p2_client_pair *cp;
+	struct r2p2_host_tuple *dest;
+	int iovcnt, ret;
+
+	m = &mc->members[mc->sent++];
+	dest = m->ctx.destination;
+	cp = alloc_client_pair();
+	if (!cp) {
+		member_failed(m, -ERR_NO_RID);
+		return;
+	}
+	cp->ctx = &m->ctx;
+	cp->destination = dest;
+
+	if (mc->sent == 1 ||
+		(!is_eager(get_buffer_payload(mc->request.head_buffer)) &&
+		 dest_mtu(dest) >= dest_mtu(mc->members[0].ctx.destination)))
+		ret = clone_msg(&cp->request, &mc->request, cp->request.req_id);
+	else {
+		iovcnt = prepare_to_app_iovec(&mc->request);
+		ret = prepare_msg(&cp->request, to_app_iovec, iovcnt, REQUEST_MSG,
+						  m->ctx.routing_policy, cp->request.req_id, dest,
+						  req_exts(&m->ctx));
+	}
+	if (ret) {
+		free_client_pair(cp);
+		member_failed(m, -ERR_MSG_SIZE);
+		return;
+	}
+	if (!send_prepared_req(cp, REQUEST_MSG))
+		m->handle = (long)cp;
+}
+
+static void stagger_triggered(struct wheel_timer *t);
+
+/*
+ * Send to the destinations left, all of them at once or, staggered, the
+ * next one now and another one every stagger us
+ */
+static void send_members(struct r2p2_multicall *mc)
+{
+	mc->sending = 1;
+	do
+		send_member(mc);
+	while (!mc->ended && mc->sent < mc->n && !mc->stagger);
+	mc->sending = 0;
+
+	if (mc->ended)
+		free_multicall(mc);
+	else if (mc->sent < mc->n)
+		arm_timer(&mc->stagger_timer, mc->stagger, stagger_triggered);
+	else
+		free_msg_buffers(&mc->request);
+}
+
+static void stagger_triggered(struct wheel_timer *t)
+{
+	send_members(container_of(t, struct r2p2_multicall, stagger_timer));
+}
+
+int r2p2_send_multicall(struct r2p2_host_tuple **dests, int n,
+						struct iovec *iov, int iovcnt, int k,
+						struct r2p2_ctx *ctx)
+{
+	struct r2p2_multicall_member *m;
+	struct r2p2_multicall *mc;
+	int i;
+
+	if (n > R2P2_MAX_MULTICALL || k < 1 || k > n || mixes_cq(ctx))
+		return -1;
+	mc = alloc_object(multicalls);
+	if (!mc)
+		return -1;
+	bzero(mc, sizeof(struct r2p2_multicall));
+	mc->ctx = ctx;
+	mc->n = n;
+	mc->k = k;
+	mc->stagger = ctx->stagger;
+
+	if (prepare_msg(&mc->request, iov, iovcnt, REQUEST_MSG,
+					ctx->routing_policy, 0, dests[0], req_exts(ctx))) {
+		free_object(mc);
+		return -1;
+	}
+
+	for (i = 0; i < n; i++) {
+		m = &mc->members[i];
+		m->ctx = *ctx;
+		m->ctx.success_cb = member_success;
+		m->ctx.error_cb = member_error;
+		m->ctx.timeout_cb = member_timeout;
+		m->ctx.arg = m;
+		m->ctx.destination = dests[i];
+		m->ctx.hedge_destination = NULL;
+		m->handle = 0;
+		m->mc = mc;
+	}
+
+	send_members(mc);
+	return 0;
 }
 
 #ifdef WITH_RAFT
 void r2p2_send_raft_req(struct iovec *iov, int iovcnt, struct r2p2_ctx *ctx)
 {
-	__r2p2_send_req(iov, iovcnt, ctx, RAFT_REQ);
+	__r2p2_send_req(iov, iovcnt, ctx, RAFT_REQ, 0);
 }
 #endif
 
@@ -780,11 +2834,67 @@ void r2p2_recv_resp_done(long handle)
 	free_client_pair(cp);
 }
 
+int r2p2_poll_cq(struct r2p2_cq_entry *entries, int max)
+{
+	int i;
+
+	for (i = 0; i < max && cq_count; i++) {
+		entries[i] = cq[cq_head];
+		cq_head = (cq_head + 1) & (cq_size - 1);
+		cq_count--;
+	}
+	return i;
+}
+
+int r2p2_resp_iovec(long handle, struct iovec *iov, int iovcnt)
+{
+	struct r2p2_client_pair *cp = (struct r2p2_client_pair *)handle;
+
+	return r2p2_msg_iovec(&cp->reply, iov, iovcnt);
+}
+
+void r2p2_cancel_req(long handle)
+{
+	struct r2p2_client_pair *cp = (struct r2p2_client_pair *)handle;
+
+	// The handle is the first pair of a hedged request
+	assert(!cp->hedge_copy);
+	if (cp->hedge) {
+		send_cancel(cp->hedge);
+		remove_from_pending_client_pairs(cp->hedge);
+		free_client_pair(cp->hedge);
+	}
+	// Already cancelled if it lost to its copy
+	if (cp->state != R2P2_W_HEDGE) {
+		send_cancel(cp);
+		remove_from_pending_client_pairs(cp);
+	}
+	free_client_pair(cp);
+}
+
+void r2p2_get_hedge_stats(struct r2p2_hedge_stats *stats)
+{
+	*stats = hedge_stats;
+}
+
+int r2p2_is_cancelled(long handle)
+{
+	struct r2p2_server_pair *sp = (struct r2p2_server_pair *)handle;
+
+	return __atomic_load_n(&sp->cancelled, __ATOMIC_RELAXED);
+}
+
 void r2p2_set_recv_cb(recv_fn fn)
 {
 	rfn = fn;
 }
 
+void r2p2_set_recv_stream_cb(recv_stream_fn fn)
+{
+	assert(!CFG.workers);
+	sfn = fn;
+}
+
 void r2p2_set_app_flow_control_fn(app_flow_control fn)
 {
 	afc_fn = fn;
@@ -801,8 +2911,7 @@ int gbuffer_read(struct gbuffer_reader *reader, char *dst, int size)
 			reader->current_buffer = get_buffer_next(reader->current_buffer);
 			if (!reader->current_buffer)
 				break;
-			reader->left_in_buffer = get_buffer_payload_size(reader->current_buffer);
-			reader->left_in_buffer -= sizeof(struct r2p2_header);
+			reader->left_in_buffer = pck_payload_size(reader->current_buffer);
 		}
 		src = (char *)get_buffer_payload(reader->current_buffer) +
 			(get_buffer_payload_size(reader->current_buffer) - reader->left_in_buffer);
@@ -828,8 +2937,7 @@ int gbuffer_skip(struct gbuffer_reader *reader, int size)
 			reader->current_buffer = get_buffer_next(reader->current_buffer);
 			if (!reader->current_buffer)
 				break;
-			reader->left_in_buffer = get_buffer_payload_size(reader->current_buffer);
-			reader->left_in_buffer -= sizeof(struct r2p2_header);
+			reader->left_in_buffer = pck_payload_size(reader->current_buffer);
 		}
 		if (reader->left_in_buffer < left_to_skip) {
 			left_to_skip -= reader->left_in_buffer;
@@ -845,8 +2953,7 @@ int gbuffer_skip(struct gbuffer_reader *reader, int size)
 int gbuffer_reader_init(struct gbuffer_reader *reader, generic_buffer gb)
 {
 	reader->current_buffer = gb;
-	reader->left_in_buffer = get_buffer_payload_size(gb);
-	reader->left_in_buffer -= sizeof(struct r2p2_header);
+	reader->left_in_buffer = pck_payload_size(gb);
 
 	return 0;
 }
@@ -0,0 +1,333 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2019-2021 Ecole Polytechnique Federale Lausanne (EPFL)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <r2p2/api-internal.h>
+#include <r2p2/api.h>
+#include <r2p2/mempool.h>
+#include <r2p2/submit.h>
+
+#define SUBMIT_RING_SIZE 1024
+#define SUBMIT_BATCH 32 // drained per poll at most
+#define SUBMITTED_POOL_SIZE 8192 // the entries of all submitters together
+
+enum {
+	SUBMIT_REQ,
+	SUBMIT_RESPONSE,
+	SUBMIT_RESP_DONE,
+};
+
+struct submission {
+	uint32_t seq;
+	uint8_t type;
+	struct r2p2_submitter *submitter;
+	struct r2p2_ctx ctx; // a copy, of requests
+	struct iovec *iov;
+	int iovcnt;
+	long handle;
+	void *tag;
+};
+
+/*
+ * Bounded MPSC ring (Vyukov). A slot is free for the producer taking
+ * position pos when its seq is pos, and ready for the poller once it is
+ * pos + 1. Producers race for positions with a CAS only.
+ */
+struct r2p2_engine {
+	uint32_t reserved; // entries of the submitters created, pool objects
+	uint32_t enqueue_pos __attribute__((aligned(64)));
+	uint32_t dequeue_pos __attribute__((aligned(64)));
+	struct submission slots[SUBMIT_RING_SIZE];
+};
+
+/*
+ * SPSC ring of completions from the poller to one submitter. Submitting
+ * takes a slot in it up front, so that the poller never finds it full.
+ */
+struct r2p2_submitter {
+	struct r2p2_engine *engine;
+	uint32_t size;
+	uint32_t outstanding; // submissions still owing a completion
+	uint32_t head __attribute__((aligned(64)));
+	uint32_t tail __attribute__((aligned(64)));
+	struct r2p2_cq_entry entries[];
+};
+
+// The ctx of a request from a submitter, its callbacks complete to it
+struct submitted_req {
+	struct r2p2_ctx ctx;
+	struct r2p2_submitter *submitter;
+	void *tag;
+};
+
+static __thread struct r2p2_engine *engine;
+static __thread struct fixed_mempool *submitted;
+
+void submit_init(void)
+{
+	uint32_t i;
+
+	engine = aligned_alloc(64, sizeof(struct r2p2_engine));
+	assert(engine);
+	engine->reserved = 0;
+	engine->enqueue_pos = 0;
+	engine->dequeue_pos = 0;
+	for (i = 0; i < SUBMIT_RING_SIZE; i++)
+		engine->slots[i].seq = i;
+	submitted = create_mempool(SUBMITTED_POOL_SIZE,
+							   sizeof(struct submitted_req));
+	assert(submitted);
+}
+
+static void complete(struct r2p2_submitter *s, void *tag, long handle,
+					 int status, int err)
+{
+	struct r2p2_cq_entry *e;
+
+	e = &s->entries[s->tail & (s->size - 1)];
+	e->tag = tag;
+	e->handle = handle;
+	e->status = status;
+	e->err = err;
+	__atomic_store_n(&s->tail, s->tail + 1, __ATOMIC_RELEASE);
+}
+
+static void submitted_success(long handle, void *arg,
+							  __attribute__((unused)) struct iovec *iov,
+							  __attribute__((unused)) int iovcnt)
+{
+	struct submitted_req *req = arg;
+
+	complete(req->submitter, req->tag, handle, R2P2_CQ_SUCCESS, 0);
+	free_object(req);
+}
+
+static void submitted_error(void *arg, int err)
+{
+	struct submitted_req *req = arg;
+
+	complete(req->submitter, req->tag, 0, R2P2_CQ_ERROR, err);
+	free_object(req);
+}
+
+static void submitted_timeout(void *arg)
+{
+	struct submitted_req *req = arg;
+
+	complete(req->submitter, req->tag, 0, R2P2_CQ_TIMEOUT, 0);
+	free_object(req);
+}
+
+static void send_submitted_req(struct submission *sub)
+{
+	struct submitted_req *req;
+
+	// The submitter's entries are covered by the pool since its creation
+	req = alloc_object(submitted);
+	assert(req);
+	req->ctx = sub->ctx;
+	req->ctx.success_cb = submitted_success;
+	req->ctx.error_cb = submitted_error;
+	req->ctx.timeout_cb = submitted_timeout;
+	req->ctx.arg = req;
+	req->submitter = sub->submitter;
+	req->tag = sub->ctx.arg;
+	r2p2_send_req_ex(sub->iov, sub->iovcnt, &req->ctx);
+}
+
+void submit_drain(void)
+{
+	struct submission *sub;
+	uint32_t pos;
+	int i;
+
+	for (i = 0; i < SUBMIT_BATCH; i++) {
+		pos = engine->dequeue_pos;
+		sub = &engine->slots[pos & (SUBMIT_RING_SIZE - 1)];
+		if (__atomic_load_n(&sub->seq, __ATOMIC_ACQUIRE) != pos + 1)
+			return;
+
+		switch (sub->type) {
+		case SUBMIT_REQ:
+			send_submitted_req(sub);
+			break;
+		case SUBMIT_RESPONSE:
+			r2p2_send_response(sub->handle, sub->iov, sub->iovcnt);
+			complete(sub->submitter, sub->tag, sub->handle, R2P2_CQ_SENT, 0);
+			break;
+		case SUBMIT_RESP_DONE:
+			r2p2_recv_resp_done(sub->handle);
+			break;
+		}
+
+		engine->dequeue_pos = pos + 1;
+		__atomic_store_n(&sub->seq, pos + SUBMIT_RING_SIZE, __ATOMIC_RELEASE);
+	}
+}
+
+/*
+ * Take a slot for the caller to fill, NULL if the ring is full. The slot is
+ * handed to the poller with publish().
+ */
+static struct submission *reserve(struct r2p2_engine *e, uint32_t *pos)
+{
+	struct submission *sub;
+	int32_t diff;
+
+	*pos = __atomic_load_n(&e->enqueue_pos, __ATOMIC_RELAXED);
+	for (;;) {
+		sub = &e->slots[*pos & (SUBMIT_RING_SIZE - 1)];
+		diff = (int32_t)(__atomic_load_n(&sub->seq, __ATOMIC_ACQUIRE) - *pos);
+		if (diff < 0)
+			return NULL;
+		if (diff == 0 &&
+			__atomic_compare_exchange_n(&e->enqueue_pos, pos, *pos + 1, 1,
+										__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			return sub;
+		if (diff > 0)
+			*pos = __atomic_load_n(&e->enqueue_pos, __ATOMIC_RELAXED);
+	}
+}
+
+static inline void publish(struct submission *sub, uint32_t pos)
+{
+	__atomic_store_n(&sub->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * API
+ */
+struct r2p2_engine *r2p2_get_engine(void)
+{
+	return engine;
+}
+
+struct r2p2_submitter *r2p2_submitter_create(struct r2p2_engine *e, int size)
+{
+	struct r2p2_submitter *s;
+	size_t len;
+
+	// A power of two
+	if (size <= 0 || (size & (size - 1)))
+		return NULL;
+	// Each entry may be a request in flight, they all need a pool object
+	if (__atomic_add_fetch(&e->reserved, size, __ATOMIC_RELAXED) >
+		SUBMITTED_POOL_SIZE) {
+		__atomic_sub_fetch(&e->reserved, size, __ATOMIC_RELAXED);
+		return NULL;
+	}
+	len = sizeof(struct r2p2_submitter) + size * sizeof(struct r2p2_cq_entry);
+	s = aligned_alloc(64, (len + 63) & ~(size_t)63);
+	if (!s) {
+		__atomic_sub_fetch(&e->reserved, size, __ATOMIC_RELAXED);
+		return NULL;
+	}
+	s->engine = e;
+	s->size = size;
+	s->outstanding = 0;
+	s->head = 0;
+	s->tail = 0;
+	return s;
+}
+
+void r2p2_submitter_destroy(struct r2p2_submitter *s)
+{
+	assert(!s->outstanding);
+	__atomic_sub_fetch(&s->engine->reserved, s->size, __ATOMIC_RELAXED);
+	free(s);
+}
+
+int r2p2_submit_req(struct r2p2_submitter *s, struct iovec *iov, int iovcnt,
+					struct r2p2_ctx *ctx)
+{
+	struct submission *sub;
+	uint32_t pos;
+
+	if (s->outstanding == s->size)
+		return -1;
+	sub = reserve(s->engine, &pos);
+	if (!sub)
+		return -1;
+	sub->type = SUBMIT_REQ;
+	sub->submitter = s;
+	sub->ctx = *ctx;
+	sub->iov = iov;
+	sub->iovcnt = iovcnt;
+	publish(sub, pos);
+	s->outstanding++;
+	return 0;
+}
+
+int r2p2_submit_response(struct r2p2_submitter *s, long handle,
+						 struct iovec *iov, int iovcnt, void *tag)
+{
+	struct submission *sub;
+	uint32_t pos;
+
+	if (s->outstanding == s->size)
+		return -1;
+	sub = reserve(s->engine, &pos);
+	if (!sub)
+		return -1;
+	sub->type = SUBMIT_RESPONSE;
+	sub->submitter = s;
+	sub->handle = handle;
+	sub->iov = iov;
+	sub->iovcnt = iovcnt;
+	sub->tag = tag;
+	publish(sub, pos);
+	s->outstanding++;
+	return 0;
+}
+
+int r2p2_submit_resp_done(struct r2p2_submitter *s, long handle)
+{
+	struct submission *sub;
+	uint32_t pos;
+
+	sub = reserve(s->engine, &pos);
+	if (!sub)
+		return -1;
+	sub->type = SUBMIT_RESP_DONE;
+	sub->submitter = s;
+	sub->handle = handle;
+	publish(sub, pos);
+	return 0;
+}
+
+int r2p2_submitter_poll(struct r2p2_submitter *s,
+						struct r2p2_cq_entry *entries, int max)
+{
+	uint32_t tail;
+	int i;
+
+	tail = __atomic_load_n(&s->tail, __ATOMIC_ACQUIRE);
+	for (i = 0; i < max && s->head != tail; i++)
+		entries[i] = s->entries[s->head++ & (s->size - 1)];
+	s->outstanding -= i;
+	return i;
+}
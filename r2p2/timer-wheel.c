@@ -0,0 +1,162 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2019-2021 Ecole Polytechnique Federale Lausanne (EPFL)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <assert.h>
+#include <stddef.h>
+
+#include <r2p2/timer-wheel.h>
+
+static void list_init(struct wheel_timer *head)
+{
+	head->next = head;
+	head->prev = head;
+}
+
+static void list_append(struct wheel_timer *head, struct wheel_timer *t)
+{
+	t->prev = head->prev;
+	t->next = head;
+	head->prev->next = t;
+	head->prev = t;
+}
+
+/*
+ * Put the timer in the lowest level that covers its distance from now. A
+ * timer already in the past goes to the slot processed next, one beyond the
+ * span of the wheel to the top level slot at the end of it. It is placed
+ * again with what remains when that slot is cascaded.
+ */
+static void wheel_place(struct timer_wheel *w, struct wheel_timer *t)
+{
+	uint64_t expires = t->expires, delta;
+	int level;
+
+	if (expires < w->now)
+		expires = w->now;
+	if (expires - w->now > WHEEL_MAX_TICKS)
+		expires = w->now + WHEEL_MAX_TICKS;
+	delta = expires - w->now;
+
+	for (level = 0; level < WHEEL_LEVELS - 1; level++)
+		if (delta < (1ULL << (WHEEL_BITS * (level + 1))))
+			break;
+
+	list_append(&w->slots[level][(expires >> (WHEEL_BITS * level)) &
+								 WHEEL_MASK],
+				t);
+}
+
+// Move all the timers of a slot to an on-stack list head
+static void list_splice(struct wheel_timer *from, struct wheel_timer *to)
+{
+	if (from->next == from) {
+		list_init(to);
+		return;
+	}
+	to->next = from->next;
+	to->prev = from->prev;
+	to->next->prev = to;
+	to->prev->next = to;
+	list_init(from);
+}
+
+/*
+ * Move the timers of one upper-level slot down. Returns the slot index, so
+ * that the caller knows whether the next level has to be cascaded too.
+ */
+static int wheel_cascade(struct timer_wheel *w, int level)
+{
+	struct wheel_timer head, *t;
+	int idx;
+
+	idx = (w->now >> (WHEEL_BITS * level)) & WHEEL_MASK;
+	list_splice(&w->slots[level][idx], &head);
+	while (head.next != &head) {
+		t = head.next;
+		head.next = t->next;
+		t->next->prev = &head;
+		wheel_place(w, t);
+	}
+
+	return idx;
+}
+
+void timer_wheel_init(struct timer_wheel *w, uint64_t now)
+{
+	int i, j;
+
+	w->now = now;
+	w->count = 0;
+	for (i = 0; i < WHEEL_LEVELS; i++)
+		for (j = 0; j < WHEEL_SLOTS; j++)
+			list_init(&w->slots[i][j]);
+}
+
+void timer_wheel_arm(struct timer_wheel *w, struct wheel_timer *t,
+					 uint64_t expires, wheel_timer_fn fn)
+{
+	assert(!wheel_timer_armed(t));
+
+	t->fn = fn;
+	t->expires = expires;
+	wheel_place(w, t);
+	w->count++;
+}
+
+/*
+ * Fire every timer that expires up to and including tick now. Callbacks
+ * get a disarmed timer and are free to arm or cancel any timer.
+ */
+void timer_wheel_advance(struct timer_wheel *w, uint64_t now)
+{
+	struct wheel_timer head, *t;
+	int idx, level;
+
+	// Nothing to fire, just catch up
+	if (!w->count) {
+		if (now >= w->now)
+			w->now = now + 1;
+		return;
+	}
+
+	while (w->now <= now) {
+		idx = w->now & WHEEL_MASK;
+		if (!idx)
+			for (level = 1; level < WHEEL_LEVELS; level++)
+				if (wheel_cascade(w, level))
+					break;
+
+		/*
+		 * Fire from a detached list, a timer armed from the callback
+		 * could otherwise land in the slot being processed
+		 */
+		list_splice(&w->slots[0][idx], &head);
+		w->now++;
+		while (head.next != &head) {
+			t = head.next;
+			timer_wheel_cancel(w, t);
+			t->fn(t);
+		}
+	}
+}
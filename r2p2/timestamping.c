@@ -114,7 +114,7 @@ int recv_timestamp(int sockfd, struct r2p2_host_tuple *source, void *buf,
 	struct iovec recv_iov;
 
 	recv_iov.iov_base = buf;
-	recv_iov.iov_len = BUFLEN;
+	recv_iov.iov_len = RECVLEN;
 
 	hdr.msg_iov = &recv_iov;
 	hdr.msg_iovlen = 1;
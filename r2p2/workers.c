@@ -0,0 +1,442 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2019-2021 Ecole Polytechnique Federale Lausanne (EPFL)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <assert.h>
+#include <linux/futex.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <r2p2/api-internal.h>
+#include <r2p2/api.h>
+#include <r2p2/cfg.h>
+#include <r2p2/submit.h>
+#include <r2p2/utils.h>
+#include <r2p2/workers.h>
+
+#define HELD_SIZE 1024 // initial, doubles when full
+#define WORKER_REPLIES 16 // handed to the polling core and not sent yet
+#define WORKER_SPIN_US 50 // an idle worker polls its ring before sleeping
+
+/*
+ * The requests handed to a worker, an SPSC ring from the polling core.
+ * The worker moves head past a request only once it ran, so tail - head
+ * is what JBSQ bounds. A request cancelled while queued is skipped and
+ * marked so, the polling core frees it once head is past it. An idle
+ * worker sleeps on the wake futex, which the polling core bumps when it
+ * finds it sleeping.
+ */
+struct worker {
+	struct r2p2_server_pair *ring[MAX_WORKER_DEPTH];
+	uint8_t skipped[MAX_WORKER_DEPTH];
+	uint32_t head __attribute__((aligned(64)));
+	uint32_t sleeping;
+	uint32_t exited;
+	uint32_t tail __attribute__((aligned(64)));
+	uint32_t wake;
+	uint32_t stop;
+	uint32_t reaped; // of the polling core, head as of the last reap()
+	struct r2p2_engine *engine; // of the polling core
+	pthread_t thread;
+};
+
+/*
+ * A copy of a reply, the app's iov is its own again once sent is returned.
+ * Past the WORKER_REPLIES kept ones, copies are taken from the heap.
+ */
+struct reply_copy {
+	struct iovec iov;
+	size_t size;
+	long handle;
+	struct reply_copy *next; // waiting for room in the submission rings
+	uint8_t heap;
+};
+
+// Of the polling core
+static __thread struct worker *workers;
+static __thread struct r2p2_server_pair **held; // waiting for a worker
+static __thread uint32_t held_head, held_count, held_size;
+
+// Of a worker thread
+static __thread struct worker *self;
+static __thread struct r2p2_submitter *submitter;
+static __thread struct reply_copy copies[WORKER_REPLIES];
+static __thread struct reply_copy *free_copies[WORKER_REPLIES];
+static __thread int free_copy_count;
+static __thread int copies_out; // taken and not reclaimed yet
+static __thread struct reply_copy *unsent_head, *unsent_tail;
+
+static inline int has_work(struct worker *w)
+{
+	return w->head != __atomic_load_n(&w->tail, __ATOMIC_ACQUIRE) ||
+		   __atomic_load_n(&w->stop, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Poll the ring for a while, then sleep until the polling core wakes us,
+ * or only for as long again with replies still to submit
+ */
+static void wait_for_work(void)
+{
+	struct timespec retry = {0, WORKER_SPIN_US * 1000};
+	uint32_t wake;
+	long until;
+
+	until = time_us() + WORKER_SPIN_US;
+	while (time_us() < until)
+		if (has_work(self))
+			return;
+
+	// Pairs with the check of sleeping after publishing in wake_worker()
+	__atomic_store_n(&self->sleeping, 1, __ATOMIC_SEQ_CST);
+	wake = __atomic_load_n(&self->wake, __ATOMIC_SEQ_CST);
+	if (!has_work(self))
+		syscall(SYS_futex, &self->wake, FUTEX_WAIT_PRIVATE, wake,
+				unsent_head ? &retry : NULL, NULL, 0);
+	__atomic_store_n(&self->sleeping, 0, __ATOMIC_RELAXED);
+}
+
+static void wake_worker(struct worker *w)
+{
+	if (!__atomic_load_n(&w->sleeping, __ATOMIC_SEQ_CST))
+		return;
+	__atomic_add_fetch(&w->wake, 1, __ATOMIC_SEQ_CST);
+	syscall(SYS_futex, &w->wake, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+// Take back the copies of the replies the polling core sent
+static void reclaim_copies(void)
+{
+	struct r2p2_cq_entry entries[WORKER_REPLIES];
+	struct reply_copy *c;
+	int i, n;
+
+	do {
+		n = r2p2_submitter_poll(submitter, entries, WORKER_REPLIES);
+		for (i = 0; i < n; i++) {
+			c = entries[i].tag;
+			copies_out--;
+			if (c->heap) {
+				free(c->iov.iov_base);
+				free(c);
+			} else
+				free_copies[free_copy_count++] = c;
+		}
+	} while (n == WORKER_REPLIES);
+}
+
+// Hand the copies waiting for room to the polling core, oldest first
+static void submit_unsent(void)
+{
+	struct reply_copy *c;
+
+	while ((c = unsent_head)) {
+		if (r2p2_submit_response(submitter, c->handle, &c->iov, 1, c))
+			return;
+		unsent_head = c->next;
+	}
+	unsent_tail = NULL;
+}
+
+// The polling core keeps sending our replies until we exit
+static void worker_exit(void)
+{
+	int i;
+
+	for (;;) {
+		reclaim_copies();
+		submit_unsent();
+		if (!copies_out)
+			break;
+		sched_yield();
+	}
+	for (i = 0; i < WORKER_REPLIES; i++)
+		free(copies[i].iov.iov_base);
+	r2p2_submitter_destroy(submitter);
+	__atomic_store_n(&self->exited, 1, __ATOMIC_RELEASE);
+}
+
+static void *worker_main(void *arg)
+{
+	struct r2p2_server_pair *sp;
+	uint32_t idx;
+	int i;
+
+	self = arg;
+	submitter = r2p2_submitter_create(self->engine, WORKER_REPLIES);
+	assert(submitter);
+	for (i = 0; i < WORKER_REPLIES; i++)
+		free_copies[free_copy_count++] = &copies[i];
+	for (;;) {
+		if (self->head == __atomic_load_n(&self->tail, __ATOMIC_ACQUIRE)) {
+			// Only once the requests handed to us ran
+			if (__atomic_load_n(&self->stop, __ATOMIC_ACQUIRE))
+				break;
+			reclaim_copies();
+			submit_unsent();
+			wait_for_work();
+			continue;
+		}
+		idx = self->head & (MAX_WORKER_DEPTH - 1);
+		sp = self->ring[idx];
+		if (__atomic_load_n(&sp->cancelled, __ATOMIC_RELAXED))
+			self->skipped[idx] = 1;
+		else
+			deliver_request(sp);
+		__atomic_store_n(&self->head, self->head + 1, __ATOMIC_RELEASE);
+	}
+	worker_exit();
+	return NULL;
+}
+
+static void reap(struct worker *w);
+
+// Stop and join the first count workers, sending their replies meanwhile
+static void stop_workers(int count)
+{
+	int i, running;
+
+	for (i = 0; i < count; i++) {
+		__atomic_store_n(&workers[i].stop, 1, __ATOMIC_SEQ_CST);
+		wake_worker(&workers[i]);
+	}
+	do {
+		submit_drain();
+		running = 0;
+		for (i = 0; i < count; i++)
+			running += !__atomic_load_n(&workers[i].exited, __ATOMIC_ACQUIRE);
+	} while (running);
+	for (i = 0; i < count; i++) {
+		pthread_join(workers[i].thread, NULL);
+		reap(&workers[i]);
+	}
+	free(workers);
+	workers = NULL;
+}
+
+int workers_init(void)
+{
+	int i;
+
+	if (!CFG.workers)
+		return 0;
+	held = malloc(HELD_SIZE * sizeof(struct r2p2_server_pair *));
+	assert(held);
+	held_size = HELD_SIZE;
+	workers = aligned_alloc(64, CFG.workers * sizeof(struct worker));
+	assert(workers);
+	memset(workers, 0, CFG.workers * sizeof(struct worker));
+	for (i = 0; i < CFG.workers; i++) {
+		workers[i].engine = r2p2_get_engine();
+		if (pthread_create(&workers[i].thread, NULL, worker_main,
+						   &workers[i])) {
+			stop_workers(i);
+			free(held);
+			held = NULL;
+			return -1;
+		}
+	}
+	return 0;
+}
+
+// Free the requests the worker skipped since the last reap
+static void reap(struct worker *w)
+{
+	uint32_t head, idx;
+
+	head = __atomic_load_n(&w->head, __ATOMIC_ACQUIRE);
+	for (; w->reaped != head; w->reaped++) {
+		idx = w->reaped & (MAX_WORKER_DEPTH - 1);
+		if (w->skipped[idx]) {
+			w->skipped[idx] = 0;
+			drop_cancelled_request(w->ring[idx]);
+		}
+	}
+}
+
+/*
+ * The worker with the fewest requests, NULL if all have depth of them.
+ * The slots up to reaped are free for push().
+ */
+static struct worker *least_loaded(void)
+{
+	struct worker *best = NULL;
+	uint32_t queued, best_queued = CFG.worker_depth;
+	int i;
+
+	for (i = 0; i < CFG.workers; i++) {
+		reap(&workers[i]);
+		queued = workers[i].tail - workers[i].reaped;
+		if (queued < best_queued) {
+			best = &workers[i];
+			best_queued = queued;
+		}
+	}
+	return best;
+}
+
+static void push(struct worker *w, struct r2p2_server_pair *sp)
+{
+	request_started(sp);
+	w->ring[w->tail & (MAX_WORKER_DEPTH - 1)] = sp;
+	__atomic_store_n(&w->tail, w->tail + 1, __ATOMIC_SEQ_CST);
+	wake_worker(w);
+}
+
+static void hold(struct r2p2_server_pair *sp)
+{
+	struct r2p2_server_pair **bigger;
+	uint32_t i;
+
+	if (held_count == held_size) {
+		bigger = malloc(2 * held_size * sizeof(struct r2p2_server_pair *));
+		assert(bigger);
+		for (i = 0; i < held_count; i++)
+			bigger[i] = held[(held_head + i) & (held_size - 1)];
+		free(held);
+		held = bigger;
+		held_head = 0;
+		held_size *= 2;
+	}
+	held[(held_head + held_count++) & (held_size - 1)] = sp;
+}
+
+void workers_dispatch(struct r2p2_server_pair *sp)
+{
+	struct worker *w;
+
+	// Stopped, the requests run on the polling core
+	if (!workers) {
+		request_started(sp);
+		deliver_request(sp);
+		return;
+	}
+
+	// Don't overtake the requests already waiting
+	if (!held_count && (w = least_loaded()))
+		push(w, sp);
+	else
+		hold(sp);
+}
+
+void workers_poll(void)
+{
+	struct r2p2_server_pair *sp;
+	struct worker *w;
+	int i;
+
+	if (!workers)
+		return;
+	for (i = 0; i < CFG.workers; i++)
+		reap(&workers[i]);
+	while (held_count) {
+		sp = held[held_head];
+		// The deadline may have passed or the client given up while waiting
+		if (!drop_late_request(sp) && !drop_cancelled_request(sp)) {
+			w = least_loaded();
+			if (!w)
+				return;
+			push(w, sp);
+		}
+		held_head = (held_head + 1) & (held_size - 1);
+		held_count--;
+	}
+}
+
+int in_worker(void)
+{
+	return self != NULL;
+}
+
+/*
+ * The reply is copied so that the worker moves on without waiting for the
+ * polling core to send it. With the core behind, the copies come from the
+ * heap and those the submission rings have no room for wait in unsent,
+ * so the worker never blocks on the core.
+ */
+void worker_send_response(long handle, struct iovec *iov, int iovcnt)
+{
+	struct reply_copy *c;
+	size_t len = 0;
+	char *p;
+	int i;
+
+	reclaim_copies();
+	if (free_copy_count)
+		c = free_copies[--free_copy_count];
+	else {
+		c = calloc(1, sizeof(struct reply_copy));
+		assert(c);
+		c->heap = 1;
+	}
+	copies_out++;
+
+	for (i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+	if (len > c->size) {
+		free(c->iov.iov_base);
+		c->iov.iov_base = malloc(len);
+		assert(c->iov.iov_base);
+		c->size = len;
+	}
+	p = c->iov.iov_base;
+	for (i = 0; i < iovcnt; i++) {
+		memcpy(p, iov[i].iov_base, iov[i].iov_len);
+		p += iov[i].iov_len;
+	}
+	c->iov.iov_len = len;
+	c->handle = handle;
+
+	c->next = NULL;
+	if (unsent_tail)
+		unsent_tail->next = c;
+	else
+		unsent_head = c;
+	unsent_tail = c;
+	submit_unsent();
+}
+
+void r2p2_stop_workers(void)
+{
+	struct r2p2_server_pair *sp;
+
+	if (!workers)
+		return;
+	stop_workers(CFG.workers);
+	while (held_count) {
+		sp = held[held_head];
+		held_head = (held_head + 1) & (held_size - 1);
+		held_count--;
+		if (!drop_late_request(sp) && !drop_cancelled_request(sp)) {
+			request_started(sp);
+			deliver_request(sp);
+		}
+	}
+	free(held);
+	held = NULL;
+}